@@ -1,42 +1,295 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "cstr.h"
 
-#define INTERNING_POOL_SIZE 1024
+/* Interned strings are packed into an arena together with their cstring
+ * header, aligned to ARENA_ALIGN and addressed by offset in those units.
+ * The arena is a chain of slabs where slab k holds `first << k` units, so it
+ * grows geometrically, a few dozen slabs cover any realistic number of
+ * interned strings, and the slab that owns an offset is found with an ilog2.
+ */
+#define ARENA_ALIGN 8
+#define ARENA_SLAB_SIZE (64UL << 10) /* bytes in the first slab */
+#define ARENA_SLABS 32
+
+/* slabs at least this large come from mmap and are backed by huge pages */
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+/* The interning table uses open addressing over groups of GROUP_WIDTH slots,
+ * Swiss table style.  Every slot has a control byte that is either
+ * CTRL_EMPTY or CTRL_FULL with a 7-bit tag taken from the hash, so a single
+ * vector compare filters a whole group and slots are only read on a tag match.
+ * CTRL_EMPTY is zero so that a fresh table comes from zeroed pages for free.
+ * Reclaimed entries leave CTRL_DELETED behind, which lookups probe past.
+ */
+#if defined(__AVX2__)
+#define GROUP_WIDTH 32
+#elif defined(__SSE2__)
+#define GROUP_WIDTH 16
+#else
+#define GROUP_WIDTH 8
+#endif
+
+#define CTRL_EMPTY 0x00
+#define CTRL_DELETED 0x01
+#define CTRL_FULL 0x80
+
+#define HASH_START_SIZE 64 /* must be power of 2 and multiple of GROUP_WIDTH */
+
+/* Growing the table does not rehash it in one go.  The old table is kept
+ * beside the new one and every operation migrates REHASH_STEP groups, which
+ * drains it long before the new table can fill up.
+ */
+#define REHASH_STEP 4
+
+/* cstr_reclaim() sweeps RECLAIM_STEP groups of each table per call, resuming
+ * where the previous call stopped, so that no call holds a lock for longer
+ * than that whatever the size of the table.
+ */
+#define RECLAIM_STEP 64
+
+/* With reclamation enabled, interned strings count their holders in ->ref.
+ * INTERN_PINNED entries are never reclaimed: those interned before
+ * reclamation was enabled, and those whose count saturated.  Swept entries
+ * hold INTERN_DEAD until their arena record is reused, and the records are
+ * kept on per-size free lists, linked through ->hash.
+ */
+#define INTERN_PINNED 0xFFFF
+#define INTERN_DEAD 0xFFFE
+#define FREE_CLASSES 64 /* records up to this many arena units are recycled */
+
+/* Heap strings are reference counted with biased counts.  The thread that
+ * made one owns it and counts its references in ->biased with plain loads and
+ * stores; other threads count theirs in `shared` with atomics, shifted past
+ * two flags.  Since references move between threads, shared goes negative
+ * when another thread drops one the owner took.  That thread then marks the
+ * string SHARED_QUEUED and queues it to the owner, which merges its count
+ * into shared and gives up ownership (SHARED_MERGED); from then on, all
+ * counting is atomic.  An owner also merges when its count drops to 0, and a
+ * string whose owner has exited is merged by whoever queues it.  The string
+ * is freed by whoever moves shared to 0 references with MERGED set and
+ * QUEUED clear.
+ */
+#define SHARED_MERGED 1
+#define SHARED_QUEUED 2
+#define SHARED_ONE 4
+
+struct __cstr_heap {
+    uint32_t owner;    /* thread id, 0 once merged */
+    atomic_int shared; /* other threads' references * SHARED_ONE | flags */
+    struct __cstr_data data;
+};
+
+#define heap_of(s) \
+    ((struct __cstr_heap *) ((char *) (s) - offsetof(struct __cstr_heap, data)))
+
+/* The medium tier admits a string on its second cstr_clone() in a while.
+ * Lookups go to the table and the snapshot first, so strings already there
+ * are always found.  A miss records the string in a doorkeeper, a Bloom
+ * filter of DOORKEEPER_BITS with two bits per string, and only a string the
+ * filter already holds is inserted; the others get a heap copy.  The filter
+ * is cleared once 1/DOORKEEPER_FILL of its bits are set, so it remembers the
+ * last DOORKEEPER_BITS / (2 * DOORKEEPER_FILL) or so strings and lets a
+ * one-off string in with a probability below 1/DOORKEEPER_FILL^2.
+ */
+#define DOORKEEPER_ORDER 18
+#define DOORKEEPER_BITS (1 << DOORKEEPER_ORDER)
+#define DOORKEEPER_FILL 8
+
+/* Symbol ids index a chunked array of cstrings laid out like the arena, with
+ * ID_CHUNK entries in the first chunk, so entries never move and
+ * cstr_id_str() reads them without the lock.
+ */
+#define ID_CHUNK 1024
 
-#define HASH_START_SIZE 16 /* must be power of 2 */
+/* A snapshot file is a struct __cstr_snapshot followed by the control bytes,
+ * the slots and the arena of a table, at the offsets the header gives.  Slot
+ * offsets count ARENA_ALIGN units from the start of the arena, and records
+ * are stored with a NULL cstr, which the first lookup that finds them fills
+ * in, so the file holds no pointers and loading it is a single mmap.  The
+ * layout is that of the running build: a file written with another
+ * GROUP_WIDTH, hash seed, header layout or byte order is refused.
+ */
+#define SNAPSHOT_MAGIC "CSTRSNAP"
+#define SNAPSHOT_VERSION 1
 
-struct __cstr_node {
-    char buffer[CSTR_INTERNING_SIZE];
-    struct __cstr_data str;
-    struct __cstr_node *next;
+struct __cstr_snapshot {
+    char magic[8];
+    uint32_t version;
+    uint32_t group_width;
+    uint64_t seed;
+    uint32_t header; /* sizeof(struct __cstr_data) */
+    uint32_t total;  /* strings */
+    uint32_t size;   /* slots */
+    uint32_t align;  /* ARENA_ALIGN */
+    uint64_t ctrl;   /* file offsets */
+    uint64_t slot;
+    uint64_t arena;
+    uint64_t arena_size;
 };
 
-struct __cstr_pool {
-    struct __cstr_node node[INTERNING_POOL_SIZE];
+/* The length lives in the record header, which a tag match reads anyway. */
+struct __cstr_slot {
+    uint32_t hash;
+    uint32_t offset; /* arena offset of the cstring header */
+};
+
+struct __cstr_table {
+    uint8_t *ctrl;
+    struct __cstr_slot *slot;
+    unsigned size; /* slots */
+    unsigned tomb; /* CTRL_DELETED slots */
+    void *mem;     /* allocation ctrl is aligned in */
+};
+
+struct __cstr_slabs {
+    size_t first; /* units in slab 0 */
+    size_t unit;  /* bytes per unit */
+    char *slab[ARENA_SLABS];
+    unsigned nslab; /* slabs allocated so far */
+    size_t used;    /* units handed out, counted across all slabs */
+    size_t skipped; /* units lost at the tail of full slabs */
 };
 
 struct __cstr_interning {
-    int lock;
-    int index;
-    unsigned size;
-    unsigned total;
-    struct __cstr_node **hash;
-    struct __cstr_pool *pool;
+    atomic_int lock;
+    unsigned total;            /* entries in table and old together */
+    struct __cstr_table table; /* receives all insertions */
+    struct __cstr_table old;   /* drained into table, empty when size is 0 */
+    unsigned rehash;           /* next slot of old to migrate */
+    unsigned sweep;            /* next slot of table to reclaim from */
+    struct __cstr_slabs arena; /* struct __cstr_data followed by the bytes */
+    uint32_t free[FREE_CLASSES]; /* reclaimed records by units, offset + 1 */
+
+    /* A loaded snapshot: a read-only index over a flat arena, both mapped
+     * from the file.  Probed after table and old, never inserted into.  Only
+     * __cstr_ctx has one, which serves every tier and is set up under the
+     * locks of all of them.
+     */
+    struct __cstr_table snap;
+    char *snap_arena;
+    unsigned snap_total;
+
+    struct __cstr_slabs ids; /* the cstring of every symbol id */
+    uint32_t nid;            /* ids handed out, written with release */
+
+    /* protected by the lock like the rest */
+    size_t padding;   /* record bytes lost to ARENA_ALIGN */
+    size_t expands;   /* expand() calls */
+    uint64_t rehash_ns; /* time in expand() and migration */
+    size_t literal_units; /* arena units taken by the startup literals */
+};
+
+static bool __cstr_reclaim;
+
+/* Every thread keeps a direct-mapped cache of the strings it interned
+ * recently, indexed by hash and checked against length and bytes, in front of
+ * the shared table.  Interned strings are immutable and never move, so a hit
+ * needs neither the lock nor any write outside the thread.
+ */
+#define CSTR_CACHE_SIZE 256 /* must be power of 2 */
+
+/* cstr_clone_batch() takes the lock once per CSTR_BATCH short strings, and
+ * prefetches the table PREFETCH_DISTANCE keys ahead of the one it resolves.
+ */
+#define CSTR_BATCH 256
+#define PREFETCH_DISTANCE 8
+
+#define CACHE_LINE 64
+
+struct __cstr_cache_entry {
+    cstring str;
+    uint32_t hash;
+    uint32_t length;
 };
 
-static struct __cstr_interning __cstr_ctx;
+/* Per-thread counters.  Only the owning thread writes them, with relaxed
+ * atomics that compile to plain loads and stores; readers sum the live
+ * threads and what exited threads left in __cstr_retired.  The block also
+ * carries the thread's id as a heap string owner, and the strings other
+ * threads queued for it to merge, under __cstr_stats_lock.  Blocks start on
+ * a cache line and fill whole ones, so threads never write to a shared line.
+ */
+struct __cstr_tstats {
+    _Alignas(CACHE_LINE) atomic_size_t cache_hit;
+    atomic_size_t cache_miss;
+    atomic_size_t lock_acquire;
+    atomic_size_t lock_spin;
+    atomic_size_t lock_sleep;
+    atomic_size_t intern_hit;
+    atomic_size_t intern_miss;
+    atomic_size_t reclaimed;
+    atomic_size_t alloc_heap;
+    atomic_size_t alloc_intern;
+    atomic_size_t alloc_stack;
+    atomic_size_t medium_deferred;
+    struct __cstr_tstats *next;
 
-/* FIXME: use C11 atomics */
-#define CSTR_LOCK()                                               \
-    ({                                                            \
-        while (__sync_lock_test_and_set(&(__cstr_ctx.lock), 1)) { \
-        }                                                         \
-    })
-#define CSTR_UNLOCK() ({ __sync_lock_release(&(__cstr_ctx.lock)); })
+    uint32_t tid; /* never reused */
+    atomic_size_t nqueue;
+    size_t qcap;
+    struct __cstr_heap **queue;
+};
+
+static __thread struct __cstr_cache_entry __cstr_cache[CSTR_CACHE_SIZE];
+static __thread struct __cstr_tstats *__cstr_self;
+
+static pthread_mutex_t __cstr_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct __cstr_tstats *__cstr_threads, __cstr_retired;
+static pthread_once_t __cstr_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t __cstr_stats_key;
+static uint32_t __cstr_next_tid;
+
+static struct __cstr_interning __cstr_ctx = {
+    .arena = {.first = ARENA_SLAB_SIZE / ARENA_ALIGN, .unit = ARENA_ALIGN},
+    .ids = {.first = ID_CHUNK, .unit = sizeof(cstring)},
+};
+
+/* The medium tier: its own lock, table and arena.  Symbol ids and snapshots
+ * only live in __cstr_ctx.
+ */
+static struct __cstr_interning __cstr_medium = {
+    .arena = {.first = ARENA_SLAB_SIZE / ARENA_ALIGN, .unit = ARENA_ALIGN},
+};
+
+/* under the lock of __cstr_medium */
+static uint64_t __cstr_doorkeeper[DOORKEEPER_BITS / 64];
+static unsigned __cstr_doorkeeper_set;
+
+/* The lock word is 0 when free, 1 when held and 2 when held with sleepers.
+ * Contended acquirers spin with exponential backoff, reading the word before
+ * trying to take it, and fall back to a futex after LOCK_SPIN_LIMIT pauses,
+ * so a preempted holder does not burn the timeslices of every waiter.
+ */
+#define LOCK_SPIN_LIMIT 1024
+
+#define CSTR_LOCK() cstr_lock(&__cstr_ctx.lock)
+#define CSTR_UNLOCK() cstr_unlock(&__cstr_ctx.lock)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
 
 static void *xalloc(size_t n)
 {
@@ -46,38 +299,599 @@ static void *xalloc(size_t n)
     return m;
 }
 
-static inline void insert_node(struct __cstr_node **hash,
-                               int sz,
-                               struct __cstr_node *node)
+/* Large slabs are mapped directly so that they can sit on huge pages:
+ * explicitly with -DCSTR_HUGETLB (needs reserved hugetlbfs pages), otherwise
+ * through transparent huge pages.  Slabs are never returned.
+ */
+static void *slab_alloc(size_t n)
+{
+    if (n < HUGE_PAGE_SIZE)
+        return xalloc(n);
+
+    n = (n + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    void *m = MAP_FAILED;
+#ifdef CSTR_HUGETLB
+    m = mmap(NULL, n, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (m == MAP_FAILED) {
+        m = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0);
+        if (m == MAP_FAILED)
+            exit(-1);
+#ifdef MADV_HUGEPAGE
+        madvise(m, n, MADV_HUGEPAGE);
+#endif
+    }
+    return m;
+}
+
+/* lowerbound (floor log2) */
+static inline unsigned ilog2(size_t n)
+{
+    return 8 * sizeof(long) - __builtin_clzl(n) - 1;
+}
+
+/* first unit of slab k */
+static inline size_t slab_start(const struct __cstr_slabs *s, unsigned k)
+{
+    return s->first * (((size_t) 1 << k) - 1);
+}
+
+static inline void *slabs_at(const struct __cstr_slabs *s, size_t i)
+{
+    unsigned k = ilog2(i / s->first + 1);
+    return s->slab[k] + s->unit * (i - slab_start(s, k));
+}
+
+/* Hand out n contiguous units and return the index of the first one.  A run
+ * never straddles two slabs; the tail of a slab that is too short is skipped,
+ * and so are whole slabs until one is large enough.  Callers keep indices in
+ * 32 bits.
+ */
+static size_t slabs_alloc(struct __cstr_slabs *s, size_t n)
+{
+    while (s->used + n > slab_start(s, s->nslab)) {
+        if (s->nslab == ARENA_SLABS)
+            exit(-1);
+        s->slab[s->nslab] = slab_alloc(s->unit * (s->first << s->nslab));
+        if (s->used < slab_start(s, s->nslab)) {
+            s->skipped += slab_start(s, s->nslab) - s->used;
+            s->used = slab_start(s, s->nslab);
+        }
+        ++s->nslab;
+    }
+    if (s->used + n > UINT32_MAX)
+        exit(-1);
+    size_t i = s->used;
+    s->used += n;
+    return i;
+}
+
+static inline void stat_add(atomic_size_t *c, size_t n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline size_t stat_get(atomic_size_t *c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+#define STATS_FOLD(dst, src, field) \
+    stat_add(&(dst)->field, stat_get(&(src)->field))
+
+static void stats_fold(struct __cstr_tstats *dst, struct __cstr_tstats *src)
+{
+    STATS_FOLD(dst, src, cache_hit);
+    STATS_FOLD(dst, src, cache_miss);
+    STATS_FOLD(dst, src, lock_acquire);
+    STATS_FOLD(dst, src, lock_spin);
+    STATS_FOLD(dst, src, lock_sleep);
+    STATS_FOLD(dst, src, intern_hit);
+    STATS_FOLD(dst, src, intern_miss);
+    STATS_FOLD(dst, src, reclaimed);
+    STATS_FOLD(dst, src, alloc_heap);
+    STATS_FOLD(dst, src, alloc_intern);
+    STATS_FOLD(dst, src, alloc_stack);
+    STATS_FOLD(dst, src, medium_deferred);
+}
+
+static void brc_merge(struct __cstr_heap *h, uint32_t biased, int flags);
+
+static void stats_exit(void *p)
+{
+    struct __cstr_tstats *st = p, **pp;
+    pthread_mutex_lock(&__cstr_stats_lock);
+    for (size_t i = 0; i < st->nqueue; i++)
+        brc_merge(st->queue[i], st->queue[i]->data.biased, SHARED_QUEUED);
+    free(st->queue);
+    stats_fold(&__cstr_retired, st);
+    for (pp = &__cstr_threads; *pp != st; pp = &(*pp)->next)
+        ;
+    *pp = st->next;
+    pthread_mutex_unlock(&__cstr_stats_lock);
+    /* a destructor that runs after this one registers a fresh block */
+    __cstr_self = NULL;
+    free(st);
+}
+
+static void stats_key_init(void)
+{
+    pthread_key_create(&__cstr_stats_key, stats_exit);
+}
+
+static struct __cstr_tstats *thread_stats(void)
+{
+    struct __cstr_tstats *st = __cstr_self;
+    if (__builtin_expect(!!st, 1))
+        return st;
+
+    st = aligned_alloc(CACHE_LINE, sizeof(*st));
+    if (!st)
+        exit(-1);
+    memset(st, 0, sizeof(*st));
+    pthread_once(&__cstr_stats_once, stats_key_init);
+    pthread_setspecific(__cstr_stats_key, st);
+    pthread_mutex_lock(&__cstr_stats_lock);
+    st->tid = ++__cstr_next_tid;
+    st->next = __cstr_threads;
+    __cstr_threads = st;
+    pthread_mutex_unlock(&__cstr_stats_lock);
+    return __cstr_self = st;
+}
+
+/* Give up ownership of h, folding in the biased references, and clear
+ * `flags` from shared.  Only the first merge adds anything; whoever leaves
+ * shared at no references with only SHARED_MERGED set frees h.
+ */
+static void brc_merge(struct __cstr_heap *h, uint32_t biased, int flags)
+{
+    int v = atomic_load_explicit(&h->shared, memory_order_relaxed), n;
+    __atomic_store_n(&h->owner, 0, __ATOMIC_RELEASE);
+    do {
+        n = v & SHARED_MERGED ? v
+                              : (v + (int) biased * SHARED_ONE) | SHARED_MERGED;
+        n &= ~flags;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &h->shared, &v, n, memory_order_acq_rel, memory_order_relaxed));
+    if (n == SHARED_MERGED && n != v)
+        free(h);
+}
+
+/* merge what other threads queued for this one */
+static void brc_drain(struct __cstr_tstats *st)
+{
+    pthread_mutex_lock(&__cstr_stats_lock);
+    struct __cstr_heap **q = st->queue;
+    size_t n = st->nqueue;
+    st->queue = NULL;
+    st->qcap = 0;
+    atomic_store_explicit(&st->nqueue, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&__cstr_stats_lock);
+
+    for (size_t i = 0; i < n; i++)
+        brc_merge(q[i], q[i]->data.biased, SHARED_QUEUED);
+    free(q);
+}
+
+static inline void brc_poll(struct __cstr_tstats *st)
+{
+    if (__builtin_expect(
+            !!atomic_load_explicit(&st->nqueue, memory_order_relaxed), 0))
+        brc_drain(st);
+}
+
+/* Hand h, which this thread just marked SHARED_QUEUED, to its owner, or merge
+ * it here if the owner is gone.  Thread ids are not reused, so an owner
+ * missing from the list has exited and drained its queue.
+ */
+static void brc_queue(struct __cstr_heap *h)
+{
+    uint32_t owner = __atomic_load_n(&h->owner, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_lock(&__cstr_stats_lock);
+    struct __cstr_tstats *st = __cstr_threads;
+    while (owner && st && st->tid != owner)
+        st = st->next;
+    if (owner && st) {
+        if (st->nqueue == st->qcap) {
+            st->qcap = st->qcap ? st->qcap * 2 : 16;
+            st->queue = realloc(st->queue, sizeof(*st->queue) * st->qcap);
+            if (!st->queue)
+                exit(-1);
+        }
+        st->queue[st->nqueue] = h;
+        atomic_store_explicit(&st->nqueue, st->nqueue + 1,
+                              memory_order_relaxed);
+        h = NULL;
+    }
+    pthread_mutex_unlock(&__cstr_stats_lock);
+    /* owner 0: it gave up with biased at 0 before saying so */
+    if (h)
+        brc_merge(h, h->data.biased, SHARED_QUEUED);
+}
+
+static void brc_get(struct __cstr_heap *h)
+{
+    struct __cstr_tstats *st = thread_stats();
+    if (__atomic_load_n(&h->owner, __ATOMIC_RELAXED) == st->tid)
+        ++h->data.biased;
+    else
+        atomic_fetch_add_explicit(&h->shared, SHARED_ONE,
+                                  memory_order_relaxed);
+}
+
+static void brc_put(struct __cstr_heap *h)
+{
+    struct __cstr_tstats *st = thread_stats();
+    brc_poll(st);
+    if (__atomic_load_n(&h->owner, __ATOMIC_RELAXED) == st->tid) {
+        if (--h->data.biased)
+            return;
+        /* Shared at 0 with no flags: no other thread holds a reference or
+         * can take one, so the string goes without an atomic write.  A
+         * queued string is left for the queue to free.
+         */
+        if (atomic_load_explicit(&h->shared, memory_order_acquire) == 0)
+            free(h);
+        else
+            brc_merge(h, 0, 0);
+        return;
+    }
+
+    int v = atomic_load_explicit(&h->shared, memory_order_relaxed), n;
+    bool queue;
+    do {
+        n = v - SHARED_ONE;
+        queue = !(v & (SHARED_MERGED | SHARED_QUEUED)) && n < 0;
+        if (queue)
+            n |= SHARED_QUEUED;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &h->shared, &v, n, memory_order_acq_rel, memory_order_relaxed));
+    if (queue)
+        brc_queue(h);
+    else if (n == SHARED_MERGED)
+        free(h);
+}
+
+/* sum of the counters of every thread, live or gone */
+static void stats_collect(struct __cstr_tstats *sum)
 {
-    uint32_t h = node->str.hash_size;
-    int index = h & (sz - 1);
-    node->next = hash[index];
-    hash[index] = node;
+    memset(sum, 0, sizeof(*sum));
+    pthread_mutex_lock(&__cstr_stats_lock);
+    stats_fold(sum, &__cstr_retired);
+    for (struct __cstr_tstats *st = __cstr_threads; st; st = st->next)
+        stats_fold(sum, st);
+    pthread_mutex_unlock(&__cstr_stats_lock);
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void futex_wait(atomic_int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(atomic_int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void cstr_lock_slow(atomic_int *lock, struct __cstr_tstats *st)
+{
+    size_t spins = 0;
+    int c;
+
+    for (unsigned backoff = 1; backoff <= LOCK_SPIN_LIMIT; backoff <<= 1) {
+        for (unsigned i = 0; i < backoff; i++)
+            cpu_relax();
+        spins += backoff;
+        c = 0;
+        if (!atomic_load_explicit(lock, memory_order_relaxed) &&
+            atomic_compare_exchange_weak_explicit(lock, &c, 1,
+                                                  memory_order_acquire,
+                                                  memory_order_relaxed))
+            goto out;
+    }
+
+    /* Whoever leaves the futex owns the lock in state 2: there may be other
+     * sleepers, so the unlock has to wake one.
+     */
+    while (atomic_exchange_explicit(lock, 2, memory_order_acquire)) {
+        stat_add(&st->lock_sleep, 1);
+        futex_wait(lock, 2);
+    }
+out:
+    stat_add(&st->lock_spin, spins);
+}
+
+static inline void cstr_lock(atomic_int *lock)
+{
+    struct __cstr_tstats *st = thread_stats();
+    int c = 0;
+
+    stat_add(&st->lock_acquire, 1);
+    if (!atomic_compare_exchange_strong_explicit(
+            lock, &c, 1, memory_order_acquire, memory_order_relaxed))
+        cstr_lock_slow(lock, st);
+}
+
+static inline void cstr_unlock(atomic_int *lock)
+{
+    if (atomic_exchange_explicit(lock, 0, memory_order_release) == 2)
+        futex_wake(lock);
+}
+
+static inline cstring arena_at(struct __cstr_interning *si, uint32_t offset)
+{
+    return slabs_at(&si->arena, offset);
+}
+
+/* The low bits of the hash pick the group; the tag comes from a multiplicative
+ * mix of all of them, so it stays independent of the group index.
+ */
+static inline uint8_t hash_tag(uint32_t hash)
+{
+    return CTRL_FULL | (hash * 0x9E3779B1U) >> 25;
+}
+
+/* bit i is set when ctrl[i] == c */
+static inline uint32_t group_match(const uint8_t *ctrl, uint8_t c)
+{
+#if defined(__AVX2__)
+    __m256i g = _mm256_load_si256((const __m256i *) ctrl);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(g, _mm256_set1_epi8(c)));
+#elif defined(__SSE2__)
+    __m128i g = _mm_load_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+        mask |= (uint32_t) (ctrl[i] == c) << i;
+    return mask;
+#endif
+}
+
+/* Walk the groups of t starting from the one hash points at.  Triangular
+ * steps visit every group once because the group count is a power of 2.
+ */
+#define for_each_group(t, hash, g, i)                                      \
+    for (unsigned i = 0, g = (hash) & ((t)->size / GROUP_WIDTH - 1);       \
+         i < (t)->size / GROUP_WIDTH;                                      \
+         g = (g + ++i) & ((t)->size / GROUP_WIDTH - 1))
+
+static cstring table_find(struct __cstr_interning *si,
+                          const struct __cstr_table *t,
+                          const char *cstr,
+                          size_t sz,
+                          uint32_t hash)
+{
+    uint8_t tag = hash_tag(hash);
+    for_each_group(t, hash, g, i)
+    {
+        const uint8_t *ctrl = t->ctrl + g * GROUP_WIDTH;
+        for (uint32_t m = group_match(ctrl, tag); m; m &= m - 1) {
+            const struct __cstr_slot *s =
+                &t->slot[g * GROUP_WIDTH + __builtin_ctz(m)];
+            if (s->hash == hash) {
+                cstring cs = arena_at(si, s->offset);
+                if (cs->size == sz && !memcmp(cs->cstr, cstr, sz))
+                    return cs;
+            }
+        }
+        if (group_match(ctrl, CTRL_EMPTY))
+            break;
+    }
+    return NULL;
+}
+
+/* table_find() over a loaded snapshot */
+static cstring snapshot_find(struct __cstr_interning *si,
+                             const char *cstr,
+                             size_t sz,
+                             uint32_t hash)
+{
+    const struct __cstr_table *t = &si->snap;
+    uint8_t tag = hash_tag(hash);
+    for_each_group(t, hash, g, i)
+    {
+        const uint8_t *ctrl = t->ctrl + g * GROUP_WIDTH;
+        for (uint32_t m = group_match(ctrl, tag); m; m &= m - 1) {
+            const struct __cstr_slot *s =
+                &t->slot[g * GROUP_WIDTH + __builtin_ctz(m)];
+            if (s->hash != hash)
+                continue;
+            cstring cs = (cstring) (si->snap_arena +
+                                    (size_t) s->offset * ARENA_ALIGN);
+            if (cs->size == sz && !memcmp(cs + 1, cstr, sz)) {
+                if (!cs->cstr)
+                    cs->cstr = (char *) (cs + 1);
+                return cs;
+            }
+        }
+        if (group_match(ctrl, CTRL_EMPTY))
+            break;
+    }
+    return NULL;
+}
+
+/* first group on the probe sequence of hash */
+static inline void table_prefetch(const struct __cstr_table *t, uint32_t hash)
+{
+    if (!t->size)
+        return;
+    unsigned g = hash & (t->size / GROUP_WIDTH - 1);
+    __builtin_prefetch(t->ctrl + g * GROUP_WIDTH);
+    __builtin_prefetch(&t->slot[g * GROUP_WIDTH]);
+}
+
+/* first free slot on the probe sequence of hash, marked as taken */
+static struct __cstr_slot *table_claim(struct __cstr_table *t, uint32_t hash)
+{
+    for_each_group(t, hash, g, i)
+    {
+        uint8_t *ctrl = t->ctrl + g * GROUP_WIDTH;
+        uint32_t m = group_match(ctrl, CTRL_EMPTY);
+        if (m) {
+            unsigned n = g * GROUP_WIDTH + __builtin_ctz(m);
+            t->ctrl[n] = hash_tag(hash);
+            return &t->slot[n];
+        }
+    }
+    return NULL; /* unreachable below the load factor */
+}
+
+/* Neither array is written here: large ones come straight from the kernel
+ * as zero pages, so creating a table costs O(1) whatever its size.
+ */
+static void table_init(struct __cstr_table *t, unsigned size)
+{
+    t->mem = calloc(size + 64, 1);
+    if (!t->mem)
+        exit(-1);
+    t->ctrl = (uint8_t *) (((uintptr_t) t->mem + 63) & ~(uintptr_t) 63);
+    t->slot = xalloc(sizeof(struct __cstr_slot) * size);
+    t->size = size;
+    t->tomb = 0;
+}
+
+static void table_free(struct __cstr_table *t)
+{
+    free(t->mem);
+    free(t->slot);
+    t->size = 0;
+}
+
+/* Move up to `groups` groups of the old table into the current one.  Slots
+ * are left in place in the old table, which stays valid for lookups until it
+ * is dropped.
+ */
+static void rehash_step(struct __cstr_interning *si, unsigned groups)
+{
+    struct __cstr_table *old = &si->old;
+    if (!old->size)
+        return;
+
+    uint64_t start = now_ns();
+    unsigned end = si->rehash + groups * GROUP_WIDTH;
+    if (end > old->size || end < si->rehash)
+        end = old->size;
+    for (unsigned i = si->rehash; i < end; ++i) {
+        if (old->ctrl[i] & CTRL_FULL)
+            *table_claim(&si->table, old->slot[i].hash) = old->slot[i];
+    }
+    si->rehash = end;
+    if (end == old->size)
+        table_free(old);
+    si->rehash_ns += now_ns() - start;
 }
 
 static void expand(struct __cstr_interning *si)
 {
-    unsigned new_size = si->size * 2;
+    /* mostly tombstones: rebuild at the same size */
+    unsigned new_size = si->table.size;
+    if (si->total * 2 >= si->table.size)
+        new_size *= 2;
     if (new_size < HASH_START_SIZE)
         new_size = HASH_START_SIZE;
 
-    struct __cstr_node **new_hash =
-        xalloc(sizeof(struct __cstr_node *) * new_size);
-    memset(new_hash, 0, sizeof(struct __cstr_node *) * new_size);
+    /* only if growth outpaced migration */
+    rehash_step(si, -1U);
+    uint64_t start = now_ns();
+    if (si->table.size) {
+        si->old = si->table;
+        si->rehash = 0;
+    }
+    si->sweep = 0;
+    table_init(&si->table, new_size);
+    ++si->expands;
+    si->rehash_ns += now_ns() - start;
+}
 
-    for (unsigned i = 0; i < si->size; ++i) {
-        struct __cstr_node *node = si->hash[i];
-        while (node) {
-            struct __cstr_node *tmp = node->next;
-            insert_node(new_hash, new_size, node);
-            node = tmp;
-        }
+/* Take a reference to a live interned string without the lock.  Fails on
+ * entries nobody holds, which only the lock may revive, and on swept ones.
+ */
+static bool intern_tryget(cstring cs)
+{
+    uint16_t r = __atomic_load_n(&cs->ref, __ATOMIC_RELAXED);
+    do {
+        if (r == INTERN_PINNED)
+            return true;
+        if (r == 0 || r == INTERN_DEAD)
+            return false;
+    } while (!__atomic_compare_exchange_n(&cs->ref, &r,
+                                          r + 1 == INTERN_DEAD ? INTERN_PINNED
+                                                               : r + 1,
+                                          true, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+    return true;
+}
+
+/* like intern_tryget(), but the caller holds the lock or a reference */
+static void intern_get(cstring cs)
+{
+    uint16_t r = __atomic_load_n(&cs->ref, __ATOMIC_RELAXED);
+    do {
+        if (r == INTERN_PINNED)
+            return;
+    } while (!__atomic_compare_exchange_n(&cs->ref, &r,
+                                          r + 1 == INTERN_DEAD ? INTERN_PINNED
+                                                               : r + 1,
+                                          true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+}
+
+/* Drop a reference.  Entries reaching 0 stay in the table, where lookups can
+ * still revive them, until cstr_reclaim() sweeps them.
+ */
+static void intern_put(cstring cs)
+{
+    uint16_t r = __atomic_load_n(&cs->ref, __ATOMIC_RELAXED);
+    do {
+        if (r == INTERN_PINNED || r == 0)
+            return;
+    } while (!__atomic_compare_exchange_n(&cs->ref, &r, r - 1, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static uint32_t record_alloc(struct __cstr_interning *si, size_t units)
+{
+    if (units < FREE_CLASSES && si->free[units]) {
+        uint32_t offset = si->free[units] - 1;
+        si->free[units] = arena_at(si, offset)->hash;
+        return offset;
     }
+    return slabs_alloc(&si->arena, units);
+}
 
-    free(si->hash);
-    si->hash = new_hash;
-    si->size = new_size;
+/* the string in si or in the snapshot, without inserting it */
+static cstring interning_find(struct __cstr_interning *si,
+                              const char *cstr,
+                              size_t sz,
+                              uint32_t hash)
+{
+    cstring cs = NULL;
+    if (si->table.size) {
+        cs = table_find(si, &si->table, cstr, sz, hash);
+        if (!cs && si->old.size)
+            cs = table_find(si, &si->old, cstr, sz, hash);
+        rehash_step(si, REHASH_STEP);
+    }
+    if (!cs && __cstr_ctx.snap.size)
+        cs = snapshot_find(&__cstr_ctx, cstr, sz, hash);
+    if (cs) {
+        if (__cstr_reclaim)
+            intern_get(cs);
+        stat_add(&thread_stats()->intern_hit, 1);
+    }
+    return cs;
 }
 
 static cstring interning(struct __cstr_interning *si,
@@ -85,172 +899,1103 @@ static cstring interning(struct __cstr_interning *si,
                          size_t sz,
                          uint32_t hash)
 {
-    if (!si->hash)
+    if (!si->table.size)
         return NULL;
 
-    int index = (int) (hash & (si->size - 1));
-    struct __cstr_node *n = si->hash[index];
-    while (n) {
-        if (n->str.hash_size == hash) {
-            if (!strcmp(n->str.cstr, cstr))
-                return &n->str;
-        }
-        n = n->next;
-    }
-    // 80% (4/5) threshold
-    if (si->total * 5 >= si->size * 4)
+    cstring cs = interning_find(si, cstr, sz, hash);
+    if (cs)
+        return cs;
+    if (sz > UINT32_MAX)
+        exit(-1);
+    // 87.5% (7/8) threshold
+    if ((si->total + si->table.tomb) * 8 >= si->table.size * 7)
         return NULL;
-    if (!si->pool) {
-        si->pool = xalloc(sizeof(struct __cstr_pool));
-        si->index = 0;
-    }
-    n = &si->pool->node[si->index++];
-    memcpy(n->buffer, cstr, sz);
-    n->buffer[sz] = 0;
 
-    cstring cs = &n->str;
-    cs->cstr = n->buffer;
-    cs->hash_size = hash;
+    size_t units = (sizeof(struct __cstr_data) + sz + 1 + ARENA_ALIGN - 1) /
+                   ARENA_ALIGN;
+    uint32_t offset = record_alloc(si, units);
+    si->padding += units * ARENA_ALIGN - (sizeof(struct __cstr_data) + sz + 1);
+    stat_add(&thread_stats()->intern_miss, 1);
+    cs = arena_at(si, offset);
+    cs->cstr = (char *) (cs + 1);
+    memcpy(cs->cstr, cstr, sz);
+    cs->cstr[sz] = 0;
+    cs->hash = hash;
+    cs->size = sz;
+    cs->id = 0;
     cs->type = CSTR_INTERNING;
-    cs->ref = 0;
+    /* publishes the bytes to intern_tryget() on a stale cached pointer */
+    __atomic_store_n(&cs->ref, __cstr_reclaim ? 1 : INTERN_PINNED,
+                     __ATOMIC_RELEASE);
 
-    n->next = si->hash[index];
-    si->hash[index] = n;
+    struct __cstr_slot *s = table_claim(&si->table, hash);
+    s->hash = hash;
+    s->offset = offset;
+    ++si->total;
 
     return cs;
 }
 
-static cstring cstr_interning(const char *cstr, size_t sz, uint32_t hash)
+/* called with the lock held */
+static cstring interning_grow(struct __cstr_interning *si,
+                              const char *cstr,
+                              size_t sz,
+                              uint32_t hash)
 {
-    cstring ret;
-    CSTR_LOCK();
-    ret = interning(&__cstr_ctx, cstr, sz, hash);
+    cstring ret = interning(si, cstr, sz, hash);
     if (!ret) {
-        expand(&__cstr_ctx);
-        ret = interning(&__cstr_ctx, cstr, sz, hash);
+        expand(si);
+        ret = interning(si, cstr, sz, hash);
     }
-    ++__cstr_ctx.total;
-    CSTR_UNLOCK();
     return ret;
 }
 
+static inline struct __cstr_cache_entry *cache_entry(uint32_t hash)
+{
+    return &__cstr_cache[hash & (CSTR_CACHE_SIZE - 1)];
+}
+
+static inline cstring cache_lookup(struct __cstr_tstats *st,
+                                   const char *cstr,
+                                   size_t sz,
+                                   uint32_t hash)
+{
+    struct __cstr_cache_entry *e = cache_entry(hash);
+    cstring cs = e->str;
+    if (e->hash != hash || e->length != sz || !cs)
+        goto miss;
+
+    if (!__cstr_reclaim) {
+        if (memcmp(cs->cstr, cstr, sz))
+            goto miss;
+    } else {
+        /* The entry may have been swept and its record reused since it was
+         * cached, so pin it first and only then check what it holds.
+         */
+        if (!intern_tryget(cs))
+            goto miss;
+        if (cs->hash != hash || cs->size != sz || memcmp(cs->cstr, cstr, sz)) {
+            intern_put(cs);
+            goto miss;
+        }
+    }
+    stat_add(&st->cache_hit, 1);
+    return cs;
+
+miss:
+    stat_add(&st->cache_miss, 1);
+    return NULL;
+}
+
+static inline void cache_fill(cstring cs, size_t sz, uint32_t hash)
+{
+    struct __cstr_cache_entry *e = cache_entry(hash);
+    e->str = cs;
+    e->hash = hash;
+    e->length = sz;
+}
+
+/* the context a string of sz bytes is interned in */
+static inline struct __cstr_interning *tier_of(size_t sz)
+{
+    if (sz >= CSTR_INTERNING_SIZE && sz < CSTR_MEDIUM_SIZE)
+        return &__cstr_medium;
+    return &__cstr_ctx;
+}
+
+static cstring cstr_interning(struct __cstr_interning *si,
+                              const char *cstr,
+                              size_t sz,
+                              uint32_t hash)
+{
+    struct __cstr_tstats *st = thread_stats();
+    cstring ret = cache_lookup(st, cstr, sz, hash);
+    if (ret)
+        return ret;
+
+    cstr_lock(&si->lock);
+    ret = interning_grow(si, cstr, sz, hash);
+    cstr_unlock(&si->lock);
+
+    cache_fill(ret, sz, hash);
+    return ret;
+}
+
+/* Whether a medium string has been seen since the doorkeeper was last
+ * cleared, marking it seen.  Called with the medium lock held.
+ */
+static bool doorkeeper_admit(uint32_t hash)
+{
+    static const uint32_t mul[2] = {0x85EBCA6BU, 0xC2B2AE35U};
+    bool seen = true;
+
+    for (int k = 0; k < 2; k++) {
+        unsigned bit = (hash * mul[k]) >> (32 - DOORKEEPER_ORDER);
+        uint64_t mask = 1ULL << (bit % 64);
+        if (__cstr_doorkeeper[bit / 64] & mask)
+            continue;
+        __cstr_doorkeeper[bit / 64] |= mask;
+        __cstr_doorkeeper_set++;
+        seen = false;
+    }
+    if (__cstr_doorkeeper_set >= DOORKEEPER_BITS / DOORKEEPER_FILL) {
+        memset(__cstr_doorkeeper, 0, sizeof(__cstr_doorkeeper));
+        __cstr_doorkeeper_set = 0;
+    }
+    return seen;
+}
+
+/* A medium string from the thread cache, the tier or the snapshot, or
+ * inserted if the doorkeeper has seen it before.  NULL if not admitted.
+ */
+static cstring medium_interning(struct __cstr_tstats *st,
+                                const char *cstr,
+                                size_t sz,
+                                uint32_t hash)
+{
+    struct __cstr_interning *si = &__cstr_medium;
+    cstring cs = cache_lookup(st, cstr, sz, hash);
+    if (cs)
+        return cs;
+
+    cstr_lock(&si->lock);
+    cs = interning_find(si, cstr, sz, hash);
+    if (!cs && doorkeeper_admit(hash))
+        cs = interning_grow(si, cstr, sz, hash);
+    cstr_unlock(&si->lock);
+
+    if (cs)
+        cache_fill(cs, sz, hash);
+    return cs;
+}
+
+/* Groups a lookup of each live entry of t probes, from slot `from` on.  The
+ * figures come from at most CHAIN_SAMPLE groups spread evenly over t, so the
+ * lock is held for a bounded time however large the table grows.  Returns
+ * the number of entries sampled.
+ */
+#define CHAIN_SAMPLE 64
+
+static size_t table_chains(const struct __cstr_table *t,
+                           unsigned from,
+                           struct cstr_stats *st)
+{
+    unsigned groups = t->size / GROUP_WIDTH, sampled = 0;
+    unsigned step = groups > CHAIN_SAMPLE ? groups / CHAIN_SAMPLE : 1;
+
+    for (unsigned grp = from / GROUP_WIDTH; grp < groups; grp += step) {
+        for (unsigned n = grp * GROUP_WIDTH; n < (grp + 1) * GROUP_WIDTH;
+             n++) {
+            if (n < from || !(t->ctrl[n] & CTRL_FULL))
+                continue;
+            size_t len = 0;
+            for_each_group(t, t->slot[n].hash, g, i)
+            {
+                ++len;
+                if (g == grp)
+                    break;
+            }
+            if (len > st->chain_max)
+                st->chain_max = len;
+            st->chain_avg += len;
+            sampled++;
+        }
+    }
+    return sampled;
+}
+
+void cstr_stats(struct cstr_stats *st)
+{
+    struct __cstr_interning *si = &__cstr_ctx;
+    struct __cstr_tstats sum;
+
+    stats_collect(&sum);
+    memset(st, 0, sizeof(*st));
+    st->intern_hit = stat_get(&sum.intern_hit);
+    st->intern_miss = stat_get(&sum.intern_miss);
+    st->cache_hit = stat_get(&sum.cache_hit);
+    st->cache_miss = stat_get(&sum.cache_miss);
+    st->reclaimed = stat_get(&sum.reclaimed);
+    st->lock_acquire = stat_get(&sum.lock_acquire);
+    st->lock_spin = stat_get(&sum.lock_spin);
+    st->lock_sleep = stat_get(&sum.lock_sleep);
+    st->alloc_heap = stat_get(&sum.alloc_heap);
+    st->alloc_intern = stat_get(&sum.alloc_intern);
+    st->alloc_stack = stat_get(&sum.alloc_stack);
+    st->medium_deferred = stat_get(&sum.medium_deferred);
+
+    CSTR_LOCK();
+    st->size = si->table.size;
+    st->total = si->total;
+    st->snapshot = si->snap_total;
+    st->ids = si->nid;
+    st->load = st->size ? (double) st->total / st->size : 0;
+    size_t sampled = table_chains(&si->table, 0, st);
+    if (si->old.size)
+        sampled += table_chains(&si->old, si->rehash, st);
+    if (sampled)
+        st->chain_avg /= sampled;
+    st->table_bytes = (size_t) (si->table.size + si->old.size) *
+                      (1 + sizeof(struct __cstr_slot));
+
+    st->slabs = si->arena.nslab;
+    st->slab_bytes = si->arena.unit * slab_start(&si->arena, si->arena.nslab);
+    st->slab_used = si->arena.unit * si->arena.used;
+    st->padding = si->padding + si->arena.unit * si->arena.skipped;
+    st->expands = si->expands;
+    st->expand_seconds = si->rehash_ns * 1e-9;
+    CSTR_UNLOCK();
+
+    si = &__cstr_medium;
+    cstr_lock(&si->lock);
+    st->medium = si->total;
+    st->table_bytes += (size_t) (si->table.size + si->old.size) *
+                       (1 + sizeof(struct __cstr_slot));
+    st->medium_slab_bytes =
+        si->arena.unit * slab_start(&si->arena, si->arena.nslab);
+    cstr_unlock(&si->lock);
+}
+
+/* Word-at-a-time hash in the style of wyhash: every 16 bytes are folded in
+ * with one 64x64->128 bit multiply, and the last 1 to 16 bytes are read
+ * zero-padded, so short keys cost two multiplies and no byte loop.  The seed
+ * is fixed at build time and the bytes are read little-endian, so hashes are
+ * stable across runs and hosts.
+ */
+#define HASH_P0 0xa0761d6478bd642fULL
+#define HASH_P1 0xe7037ed1a0b428dbULL
+#define HASH_P2 0x8ebc6af09c88c6e3ULL
+
+static inline uint64_t hash_mum(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+/* up to 8 bytes, little-endian, zero-padded */
+static inline uint64_t hash_read(const uint8_t *p, size_t n)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, n);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
 static inline uint32_t hash_blob(const char *buffer, size_t len)
 {
     const uint8_t *ptr = (const uint8_t *) buffer;
-    size_t h = len;
-    size_t step = (len >> 5) + 1;
-    for (size_t i = len; i >= step; i -= step)
-        h = h ^ ((h << 5) + (h >> 2) + ptr[i - 1]);
-    return h == 0 ? 1 : h;
+    uint64_t seed = CSTR_HASH_SEED, a, b;
+    size_t i = 0;
+
+    for (; len - i > 16; i += 16)
+        seed = hash_mum(hash_read(ptr + i, 8) ^ HASH_P1,
+                        hash_read(ptr + i + 8, 8) ^ seed);
+    a = hash_read(ptr + i, len - i > 8 ? 8 : len - i);
+    b = len - i > 8 ? hash_read(ptr + i + 8, len - i - 8) : 0;
+    seed = hash_mum(a ^ HASH_P1, b ^ seed);
+
+    uint64_t h = hash_mum(seed ^ HASH_P2, len ^ HASH_P0);
+    uint32_t h32 = h ^ (h >> 32);
+    return h32 == 0 ? 1 : h32;
+}
+
+uint32_t cstr_hash_bytes(const char *s, size_t len)
+{
+    return hash_blob(s, len);
 }
 
+static cstring heap_clone(struct __cstr_tstats *st,
+                          const char *cstr,
+                          size_t sz);
+
 cstring cstr_clone(const char *cstr, size_t sz)
 {
-    if (sz < CSTR_INTERNING_SIZE)
-        return cstr_interning(cstr, sz, hash_blob(cstr, sz));
-    cstring p = xalloc(sizeof(struct __cstr_data) + sz + 1);
-    if (!p)
-        return NULL;
+    struct __cstr_tstats *st = thread_stats();
+    if (sz < CSTR_INTERNING_SIZE) {
+        stat_add(&st->alloc_intern, 1);
+        return cstr_interning(&__cstr_ctx, cstr, sz, hash_blob(cstr, sz));
+    }
+    if (sz < CSTR_MEDIUM_SIZE) {
+        cstring cs = medium_interning(st, cstr, sz, hash_blob(cstr, sz));
+        if (cs) {
+            stat_add(&st->alloc_intern, 1);
+            return cs;
+        }
+        stat_add(&st->medium_deferred, 1);
+    }
+    return heap_clone(st, cstr, sz);
+}
+
+/* a heap string owned by this thread */
+static cstring heap_clone(struct __cstr_tstats *st, const char *cstr, size_t sz)
+{
+    stat_add(&st->alloc_heap, 1);
+    brc_poll(st);
+    struct __cstr_heap *h = xalloc(sizeof(struct __cstr_heap) + sz + 1);
+    h->owner = st->tid;
+    atomic_init(&h->shared, 0);
+    cstring p = &h->data;
     void *ptr = (void *) (p + 1);
     p->cstr = ptr;
     p->type = 0;
-    p->ref = 1;
+    p->ref = 0;
+    p->biased = 1;
     memcpy(ptr, cstr, sz);
     ((char *) ptr)[sz] = 0;
-    p->hash_size = 0;
+    p->hash = 0;
+    p->size = sz;
     return p;
 }
 
+/* Intern in three passes per CSTR_BATCH strings: hash everything and serve
+ * what the thread cache has without the lock, then, under a single lock
+ * acquisition per tier, resolve the rest while prefetching the table groups
+ * of the keys PREFETCH_DISTANCE positions ahead, so their misses overlap.
+ * Medium strings the doorkeeper turns away become heap copies afterwards.
+ */
+void cstr_clone_batch(const char **s, size_t *len, cstring *out, size_t n)
+{
+    struct __cstr_tstats *st = thread_stats();
+    uint32_t hash[CSTR_BATCH];
+    size_t pending[CSTR_BATCH], medium[CSTR_BATCH];
+
+    for (size_t base = 0; base < n; base += CSTR_BATCH) {
+        size_t end = n - base < CSTR_BATCH ? n : base + CSTR_BATCH, np = 0;
+        size_t nm = 0;
+
+        for (size_t i = base; i < end; i++) {
+            if (len[i] >= CSTR_MEDIUM_SIZE) {
+                out[i] = cstr_clone(s[i], len[i]);
+                continue;
+            }
+            hash[i - base] = hash_blob(s[i], len[i]);
+            out[i] = cache_lookup(st, s[i], len[i], hash[i - base]);
+            if (out[i])
+                stat_add(&st->alloc_intern, 1);
+            else if (len[i] < CSTR_INTERNING_SIZE)
+                pending[np++] = i;
+            else
+                medium[nm++] = i;
+        }
+
+        if (nm) {
+            struct __cstr_interning *si = &__cstr_medium;
+            cstr_lock(&si->lock);
+            for (size_t j = 0; j < nm && j < PREFETCH_DISTANCE; j++)
+                table_prefetch(&si->table, hash[medium[j] - base]);
+            for (size_t j = 0; j < nm; j++) {
+                size_t i = medium[j];
+                uint32_t h = hash[i - base];
+                if (j + PREFETCH_DISTANCE < nm)
+                    table_prefetch(&si->table,
+                                   hash[medium[j + PREFETCH_DISTANCE] - base]);
+                out[i] = interning_find(si, s[i], len[i], h);
+                if (!out[i] && doorkeeper_admit(h))
+                    out[i] = interning_grow(si, s[i], len[i], h);
+            }
+            cstr_unlock(&si->lock);
+
+            for (size_t j = 0; j < nm; j++) {
+                size_t i = medium[j];
+                if (out[i]) {
+                    stat_add(&st->alloc_intern, 1);
+                    cache_fill(out[i], len[i], hash[i - base]);
+                } else {
+                    stat_add(&st->medium_deferred, 1);
+                    out[i] = heap_clone(st, s[i], len[i]);
+                }
+            }
+        }
+        if (!np)
+            continue;
+
+        stat_add(&st->alloc_intern, np);
+        CSTR_LOCK();
+        for (size_t j = 0; j < np && j < PREFETCH_DISTANCE; j++)
+            table_prefetch(&__cstr_ctx.table, hash[pending[j] - base]);
+        for (size_t j = 0; j < np; j++) {
+            size_t i = pending[j];
+            if (j + PREFETCH_DISTANCE < np)
+                table_prefetch(&__cstr_ctx.table,
+                               hash[pending[j + PREFETCH_DISTANCE] - base]);
+            out[i] = interning_grow(&__cstr_ctx, s[i], len[i], hash[i - base]);
+        }
+        CSTR_UNLOCK();
+
+        for (size_t j = 0; j < np; j++) {
+            size_t i = pending[j];
+            cache_fill(out[i], len[i], hash[i - base]);
+        }
+    }
+}
+
+/* CSTR_LITERAL descriptors of every object linked in, if there are any */
+extern struct __cstr_literal __start_cstr_literals[] __attribute__((weak));
+extern struct __cstr_literal __stop_cstr_literals[] __attribute__((weak));
+
+/* Hash the short literals of the whole program in one pass over the section,
+ * then intern them under one lock acquisition before main() runs.
+ */
+__attribute__((constructor)) static void literals_init(void)
+{
+    struct __cstr_interning *si = &__cstr_ctx;
+
+    for (struct __cstr_literal *l = __start_cstr_literals;
+         l < __stop_cstr_literals; l++) {
+        if (!l->str)
+            l->data.hash = hash_blob(l->data.cstr, l->data.size);
+    }
+    CSTR_LOCK();
+    for (struct __cstr_literal *l = __start_cstr_literals;
+         l < __stop_cstr_literals; l++) {
+        if (l->str)
+            continue;
+        cstring cs =
+            interning_grow(si, l->data.cstr, l->data.size, l->data.hash);
+        __atomic_store_n(&l->str, cs, __ATOMIC_RELEASE);
+    }
+    si->literal_units = si->arena.used;
+    CSTR_UNLOCK();
+}
+
+cstring cstr_literal(struct __cstr_literal *lit)
+{
+    cstring cs = cstr_interning(&__cstr_ctx, lit->data.cstr, lit->data.size,
+                                hash_blob(lit->data.cstr, lit->data.size));
+    __atomic_store_n(&lit->str, cs, __ATOMIC_RELEASE);
+    return cs;
+}
+
+/* called with the lock held */
+static uint32_t id_assign(struct __cstr_interning *si, cstring cs)
+{
+    if (!cs->id) {
+        if (si->nid == UINT32_MAX)
+            exit(-1);
+        size_t i = slabs_alloc(&si->ids, 1);
+        *(cstring *) slabs_at(&si->ids, i) = cs;
+        __atomic_store_n(&cs->ref, INTERN_PINNED, __ATOMIC_RELAXED);
+        __atomic_store_n(&cs->id, i + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&si->nid, i + 1, __ATOMIC_RELEASE);
+    }
+    return cs->id - 1;
+}
+
+uint32_t cstr_intern_id(cstring s)
+{
+    struct __cstr_tstats *st = thread_stats();
+    cstring cs = NULL;
+    uint32_t hash = 0, id;
+
+    if (s->type == CSTR_INTERNING) {
+        cs = s;
+    } else {
+        hash = hash_blob(s->cstr, s->size);
+        cs = cache_lookup(st, s->cstr, s->size, hash);
+    }
+    if (cs && (id = __atomic_load_n(&cs->id, __ATOMIC_ACQUIRE)))
+        return id - 1;
+
+    if (!cs) {
+        struct __cstr_interning *si = tier_of(s->size);
+        cstr_lock(&si->lock);
+        cs = interning_grow(si, s->cstr, s->size, hash);
+        cstr_unlock(&si->lock);
+    }
+    CSTR_LOCK();
+    id = id_assign(&__cstr_ctx, cs);
+    CSTR_UNLOCK();
+    if (s != cs)
+        cache_fill(cs, s->size, hash);
+    return id;
+}
+
+cstring cstr_id_str(uint32_t id)
+{
+    if (id >= __atomic_load_n(&__cstr_ctx.nid, __ATOMIC_ACQUIRE))
+        return NULL;
+    return *(cstring *) slabs_at(&__cstr_ctx.ids, id);
+}
+
+int cstr_reclaim_enable(void)
+{
+    int ret = -1;
+    CSTR_LOCK();
+    cstr_lock(&__cstr_medium.lock);
+    /* the literals are pinned, as anything interned before is */
+    if (__cstr_ctx.arena.used == __cstr_ctx.literal_units &&
+        !__cstr_medium.arena.used) {
+        __cstr_reclaim = true;
+        ret = 0;
+    }
+    cstr_unlock(&__cstr_medium.lock);
+    CSTR_UNLOCK();
+    return ret;
+}
+
+/* Sweep the next RECLAIM_STEP groups of the table for interned strings
+ * without holders.  Their slots become tombstones and their records go to the
+ * free lists; the table is compacted by the next expand() once tombstones
+ * push it over the load factor.  A string migrated out of the old table is
+ * still found there, so while one exists the step goes to draining it.
+ */
+static size_t interning_reclaim(struct __cstr_interning *si)
+{
+    size_t n = 0;
+
+    cstr_lock(&si->lock);
+    if (si->old.size) {
+        rehash_step(si, RECLAIM_STEP);
+        cstr_unlock(&si->lock);
+        return 0;
+    }
+    struct __cstr_table *t = &si->table;
+    if (si->sweep >= t->size)
+        si->sweep = 0;
+    unsigned end = si->sweep + RECLAIM_STEP * GROUP_WIDTH;
+    if (end > t->size)
+        end = t->size;
+    for (unsigned i = si->sweep; i < end; i++) {
+        if (!(t->ctrl[i] & CTRL_FULL))
+            continue;
+        cstring cs = arena_at(si, t->slot[i].offset);
+        uint16_t r = 0;
+        if (!__atomic_compare_exchange_n(&cs->ref, &r, INTERN_DEAD, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+
+        size_t units =
+            (sizeof(struct __cstr_data) + cs->size + 1 + ARENA_ALIGN - 1) /
+            ARENA_ALIGN;
+        si->padding -=
+            units * ARENA_ALIGN - (sizeof(struct __cstr_data) + cs->size + 1);
+        if (units < FREE_CLASSES) {
+            cs->hash = si->free[units];
+            si->free[units] = t->slot[i].offset + 1;
+        }
+        t->ctrl[i] = CTRL_DELETED;
+        ++t->tomb;
+        --si->total;
+        ++n;
+    }
+    si->sweep = end;
+    cstr_unlock(&si->lock);
+    return n;
+}
+
+size_t cstr_reclaim(void)
+{
+    if (!__cstr_reclaim)
+        return 0;
+
+    size_t n = interning_reclaim(&__cstr_ctx);
+    n += interning_reclaim(&__cstr_medium);
+    stat_add(&thread_stats()->reclaimed, n);
+    return n;
+}
+
+struct snapshot_writer {
+    struct __cstr_table t;
+    char *arena;
+    size_t len, cap;
+};
+
+static void snapshot_add(struct snapshot_writer *w, cstring cs)
+{
+    size_t n = (sizeof(struct __cstr_data) + cs->size + 1 + ARENA_ALIGN - 1) &
+               ~(size_t) (ARENA_ALIGN - 1);
+    if (w->len + n > w->cap) {
+        w->cap = w->cap * 2 > w->len + n ? w->cap * 2 : w->len + n;
+        w->arena = realloc(w->arena, w->cap);
+        if (!w->arena)
+            exit(-1);
+    }
+    cstring r = (cstring) (w->arena + w->len);
+    memset(r, 0, n);
+    r->hash = cs->hash;
+    r->size = cs->size;
+    r->type = CSTR_INTERNING;
+    r->ref = INTERN_PINNED;
+    memcpy(r + 1, cs + 1, cs->size);
+
+    struct __cstr_slot *s = table_claim(&w->t, cs->hash);
+    s->hash = cs->hash;
+    s->offset = w->len / ARENA_ALIGN;
+    w->len += n;
+}
+
+static void snapshot_add_table(struct snapshot_writer *w,
+                               struct __cstr_interning *si)
+{
+    for (unsigned i = 0; i < si->table.size; i++) {
+        if (si->table.ctrl[i] & CTRL_FULL)
+            snapshot_add(w, arena_at(si, si->table.slot[i].offset));
+    }
+}
+
+int cstr_snapshot_save(const char *path)
+{
+    struct __cstr_interning *si = &__cstr_ctx;
+    struct snapshot_writer w = {0};
+    struct __cstr_snapshot h = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .group_width = GROUP_WIDTH,
+        .seed = CSTR_HASH_SEED,
+        .header = sizeof(struct __cstr_data),
+        .align = ARENA_ALIGN,
+    };
+
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -1;
+
+    CSTR_LOCK();
+    cstr_lock(&__cstr_medium.lock);
+    rehash_step(si, -1U);
+    rehash_step(&__cstr_medium, -1U);
+    h.total = si->total + si->snap_total + __cstr_medium.total;
+    h.size = HASH_START_SIZE;
+    while ((size_t) h.total * 8 >= (size_t) h.size * 7)
+        h.size *= 2;
+    table_init(&w.t, h.size);
+    snapshot_add_table(&w, si);
+    snapshot_add_table(&w, &__cstr_medium);
+    for (unsigned i = 0; i < si->snap.size; i++) {
+        if (si->snap.ctrl[i] & CTRL_FULL)
+            snapshot_add(&w, (cstring) (si->snap_arena +
+                                        (size_t) si->snap.slot[i].offset *
+                                            ARENA_ALIGN));
+    }
+    cstr_unlock(&__cstr_medium.lock);
+    CSTR_UNLOCK();
+
+    static const char zero[64];
+    h.ctrl = (sizeof(h) + 63) & ~63UL; /* group loads are aligned */
+    h.slot = h.ctrl + h.size;
+    h.arena = h.slot + (size_t) h.size * sizeof(struct __cstr_slot);
+    h.arena_size = w.len;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(zero, h.ctrl - sizeof(h), 1, f) == 1 &&
+             fwrite(w.t.ctrl, h.size, 1, f) == 1 &&
+             fwrite(w.t.slot, sizeof(struct __cstr_slot), h.size, f) ==
+                 h.size &&
+             (!w.len || fwrite(w.arena, w.len, 1, f) == 1);
+    ok = !fclose(f) && ok;
+    table_free(&w.t);
+    free(w.arena);
+    return ok ? 0 : -1;
+}
+
+static bool snapshot_valid(const struct __cstr_snapshot *h, size_t len)
+{
+    return !memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) &&
+           h->version == SNAPSHOT_VERSION && h->group_width == GROUP_WIDTH &&
+           h->seed == CSTR_HASH_SEED &&
+           h->header == sizeof(struct __cstr_data) &&
+           h->align == ARENA_ALIGN && h->size >= HASH_START_SIZE &&
+           !(h->size & (h->size - 1)) && h->total < h->size &&
+           !(h->ctrl % 64) && h->ctrl + h->size <= h->slot &&
+           !(h->slot % sizeof(uint32_t)) &&
+           h->slot + (uint64_t) h->size * sizeof(struct __cstr_slot) <=
+               h->arena &&
+           !(h->arena % ARENA_ALIGN) && h->arena + h->arena_size <= len;
+}
+
+int cstr_snapshot_load(const char *path)
+{
+    struct __cstr_interning *si = &__cstr_ctx;
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) ||
+        (size_t) st.st_size < sizeof(struct __cstr_snapshot)) {
+        close(fd);
+        return -1;
+    }
+    /* private and writable only so that cstr can be filled in on use */
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const struct __cstr_snapshot *h = (const void *) map;
+    int ret = -1;
+    CSTR_LOCK();
+    cstr_lock(&__cstr_medium.lock);
+    if (snapshot_valid(h, st.st_size) && !si->snap.size) {
+        si->snap.ctrl = (uint8_t *) map + h->ctrl;
+        si->snap.slot = (struct __cstr_slot *) (map + h->slot);
+        si->snap.size = h->size;
+        si->snap.mem = map;
+        si->snap_arena = map + h->arena;
+        si->snap_total = h->total;
+        ret = 0;
+    }
+    cstr_unlock(&__cstr_medium.lock);
+    CSTR_UNLOCK();
+    if (ret)
+        munmap(map, st.st_size);
+    return ret;
+}
+
 cstring cstr_grab(cstring s)
 {
+    if (s->type == CSTR_INTERNING && __cstr_reclaim)
+        intern_get(s);
     if (s->type & (CSTR_PERMANENT | CSTR_INTERNING))
         return s;
     if (s->type == CSTR_ONSTACK)
-        return cstr_clone(s->cstr, s->hash_size);
-    if (s->ref == 0)
-        s->type = CSTR_PERMANENT;
-    else
-        __sync_add_and_fetch(&s->ref, 1);
+        return cstr_clone(s->cstr, s->size);
+    if (s->type == CSTR_BUILDER) {
+        if (s->size < CSTR_INTERNING_SIZE)
+            return cstr_clone(s->cstr, s->size);
+        /* the medium tier takes what it would take from cstr_clone() */
+        if (s->size < CSTR_MEDIUM_SIZE) {
+            struct __cstr_tstats *st = thread_stats();
+            cstring cs = medium_interning(st, s->cstr, s->size,
+                                          hash_blob(s->cstr, s->size));
+            if (cs) {
+                stat_add(&st->alloc_intern, 1);
+                return cs;
+            }
+            stat_add(&st->medium_deferred, 1);
+        }
+        /* Freeze in place, owned by this thread: one reference for the
+         * buffer, which copies on its next cstr_cat(), and one for the caller.
+         */
+        struct __cstr_heap *h = heap_of(s);
+        h->owner = thread_stats()->tid;
+        atomic_init(&h->shared, 0);
+        s->biased = 2;
+        s->type = 0;
+        return s;
+    }
+    brc_get(heap_of(s));
     return s;
 }
 
 void cstr_release(cstring s)
 {
-    if (s->type || !s->ref)
+    if (s->type == CSTR_BUILDER) {
+        free(heap_of(s));
+        return;
+    }
+    if (s->type == CSTR_INTERNING) {
+        /* s may be swept and reused as soon as the reference is gone */
+        if (__cstr_reclaim)
+            intern_put(s);
         return;
-    if (__sync_sub_and_fetch(&s->ref, 1) == 0)
-        free(s);
+    }
+    if (s->type)
+        return;
+    brc_put(heap_of(s));
 }
 
-static size_t cstr_hash(cstring s)
+/* strings a cstr_buffer is still appending to */
+static inline bool cstr_mutable(cstring s)
 {
-    if (s->type == CSTR_ONSTACK)
-        return hash_blob(s->cstr, s->hash_size);
-    if (s->hash_size == 0)
-        s->hash_size = hash_blob(s->cstr, strlen(s->cstr));
-    return s->hash_size;
+    return s->type & (CSTR_ONSTACK | CSTR_BUILDER);
 }
 
+/* Hashing a long string costs as much as comparing it, so equality only uses
+ * hashes somebody already paid for: always there for interned strings,
+ * never for strings still being built.
+ */
 int cstr_equal(cstring a, cstring b)
 {
     if (a == b)
         return 1;
     if ((a->type == CSTR_INTERNING) && (b->type == CSTR_INTERNING))
         return 0;
-    if ((a->type == CSTR_ONSTACK) && (b->type == CSTR_ONSTACK)) {
-        if (a->hash_size != b->hash_size)
-            return 0;
-        return memcmp(a->cstr, b->cstr, a->hash_size) == 0;
-    }
-    uint32_t hasha = cstr_hash(a);
-    uint32_t hashb = cstr_hash(b);
-    if (hasha != hashb)
+    if (a->size != b->size)
         return 0;
-    return !strcmp(a->cstr, b->cstr);
+    if (!cstr_mutable(a) && !cstr_mutable(b) && a->hash && b->hash &&
+        a->hash != b->hash)
+        return 0;
+    return memcmp(a->cstr, b->cstr, a->size) == 0;
 }
 
-static cstring cstr_cat2(const char *a, const char *b)
+/* Make room for n more bytes and a terminator at the end of the string sb
+ * holds and return where they go.  Stack buffers are used while they last;
+ * past that, or when sb holds a string it cannot append to in place, the
+ * contents move to a heap builder.  Builder capacity at least doubles on
+ * every reallocation, so building a string of length n from any number of
+ * pieces copies O(n) bytes in total.
+ */
+static char *buffer_reserve(cstr_buffer sb, size_t n)
 {
-    size_t sa = strlen(a), sb = strlen(b);
-    if (sa + sb < CSTR_INTERNING_SIZE) {
-        char tmp[CSTR_INTERNING_SIZE];
-        memcpy(tmp, a, sa);
-        memcpy(tmp + sa, b, sb);
-        tmp[sa + sb] = 0;
-        return cstr_interning(tmp, sa + sb, hash_blob(tmp, sa + sb));
+    cstring s = sb->str;
+    if (s->type == CSTR_ONSTACK && s->size + n < CSTR_STACK_SIZE)
+        return s->cstr + s->size;
+
+    size_t len = s->size;
+    if (s->type == CSTR_BUILDER && len + n + 1 <= sb->capacity)
+        return s->cstr + len;
+
+    size_t cap =
+        s->type == CSTR_BUILDER ? sb->capacity * 2 : CSTR_STACK_SIZE * 2;
+    if (cap < len + n + 1)
+        cap = len + n + 1;
+    cstring p;
+    if (s->type == CSTR_BUILDER) {
+        struct __cstr_heap *h =
+            realloc(heap_of(s), sizeof(struct __cstr_heap) + cap);
+        if (!h)
+            exit(-1);
+        p = &h->data;
+    } else {
+        /* counted from when cstr_grab() freezes it */
+        p = &((struct __cstr_heap *) xalloc(sizeof(struct __cstr_heap) + cap))
+                 ->data;
+        memcpy(p + 1, s->cstr, len);
+        p->type = CSTR_BUILDER;
+        p->ref = 0;
+        p->hash = 0;
+        p->size = len;
+        p->biased = 0;
+        /* A frozen builder, or a heap or interned string the buffer was
+         * given.  Only cstr_grab() decides what gets interned, so
+         * intermediates neither take the interning lock nor stay in the
+         * table.
+         */
+        if (!cstr_mutable(s))
+            cstr_release(s);
     }
-    cstring p = xalloc(sizeof(struct __cstr_data) + sa + sb + 1);
-    if (!p)
-        return NULL;
+    p->cstr = (char *) (p + 1);
+    sb->str = p;
+    sb->capacity = cap;
+    return p->cstr + len;
+}
 
-    char *ptr = (char *) (p + 1);
-    p->cstr = ptr;
-    p->type = 0;
-    p->ref = 1;
-    memcpy(ptr, a, sa);
-    memcpy(ptr + sa, b, sb);
-    ptr[sa + sb] = 0;
-    p->hash_size = 0;
-    return p;
+/* account for n bytes written at buffer_reserve() */
+static cstring buffer_commit(cstr_buffer sb, size_t n)
+{
+    cstring s = sb->str;
+    s->size += n;
+    s->cstr[s->size] = 0;
+    if (s->type == CSTR_ONSTACK)
+        stat_add(&thread_stats()->alloc_stack, 1);
+    else
+        stat_add(&thread_stats()->alloc_heap, 1);
+    return s;
+}
+
+static inline void buffer_append(cstr_buffer sb, const char *str, size_t n)
+{
+    memcpy(buffer_reserve(sb, n), str, n);
+    sb->str->size += n;
 }
 
 cstring cstr_cat(cstr_buffer sb, const char *str)
 {
     cstring s = sb->str;
     if (s->type == CSTR_ONSTACK) {
-        int i = s->hash_size;
+        int i = s->size;
         while (i < CSTR_STACK_SIZE - 1) {
             s->cstr[i] = *str;
             if (*str == 0)
-                return s;
-            ++s->hash_size;
+                return buffer_commit(sb, 0);
+            ++s->size;
             ++str;
             ++i;
         }
         s->cstr[i] = 0;
     }
-    cstring tmp = s;
-    sb->str = cstr_cat2(tmp->cstr, str);
-    cstr_release(tmp);
-    return sb->str;
+    size_t n = strlen(str);
+    memcpy(buffer_reserve(sb, n), str, n);
+    return buffer_commit(sb, n);
+}
+
+/* Digits are written backwards from end, two at a time; returns the start. */
+static char *fmt_u64(char *end, uint64_t v)
+{
+    static const char digits[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233"
+        "34353637383940414243444546474849505152535455565758596061626364656667"
+        "6869707172737475767778798081828384858687888990919293949596979899";
+    char *p = end;
+    while (v >= 100) {
+        p -= 2;
+        memcpy(p, digits + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, digits + v * 2, 2);
+    } else {
+        *--p = '0' + v;
+    }
+    return p;
+}
+
+static char *fmt_hex(char *end, uint64_t v)
+{
+    char *p = end;
+    do {
+        *--p = "0123456789abcdef"[v & 15];
+        v >>= 4;
+    } while (v);
+    return p;
+}
+
+/* %.<prec>f of v into buf, or -1 when the digits cannot be had exactly from a
+ * double multiply: out of range, or too close to a rounding tie.
+ */
+static int fmt_fixed(char *buf, double v, int prec)
+{
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4,
+                                   1e5, 1e6, 1e7, 1e8, 1e9};
+    if (prec > 9 || !__builtin_isfinite(v))
+        return -1;
+
+    double a = __builtin_fabs(v) * pow10[prec];
+    if (a >= 9007199254740992.0) /* 2^53 */
+        return -1;
+    uint64_t r = a;
+    double frac = a - r;
+    /* the multiply is off by half an ulp of a at most */
+    if (__builtin_fabs(frac - 0.5) <= a * 0x1p-50)
+        return -1;
+    r += frac > 0.5;
+
+    uint64_t scale = pow10[prec];
+    char tmp[48], *end = tmp + sizeof(tmp), *p = end;
+    if (prec) {
+        p = fmt_u64(end, r % scale + scale) + 1; /* keeps leading zeros */
+        *--p = '.';
+    }
+    p = fmt_u64(p, r / scale);
+    if (__builtin_signbit(v))
+        *--p = '-';
+    memcpy(buf, p, end - p);
+    return end - p;
+}
+
+/* Conversions the fast path handles: %d %i %u %x %c %s %f and %%, with the
+ * length modifiers hh h l ll z and, for %f only, a precision of up to 9.
+ * Any flag, width or other conversion sends the whole format to vsnprintf.
+ */
+static bool fmt_fast(const char *fmt)
+{
+    for (const char *p = fmt; (p = strchr(p, '%')); p++) {
+        ++p;
+        if (*p == '%')
+            continue;
+        if (*p == '.') {
+            if (p[1] < '0' || p[1] > '9' || p[2] != 'f')
+                return false;
+            p += 2;
+        }
+        bool wide = false;
+        while (*p == 'h' || *p == 'l' || *p == 'z')
+            wide |= *p++ == 'l';
+        if (!*p || !strchr("diuxcsf", *p))
+            return false;
+        /* %ls and %lc take wide characters, which vsnprintf converts */
+        if (wide && (*p == 's' || *p == 'c'))
+            return false;
+    }
+    return true;
+}
+
+cstring cstr_catf(cstr_buffer sb, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    buffer_reserve(sb, 0); /* from here on sb->str is a mutable buffer */
+
+    if (!fmt_fast(fmt)) {
+        va_list aq;
+        va_copy(aq, ap);
+        cstring s = sb->str;
+        size_t cap = s->type == CSTR_ONSTACK ? CSTR_STACK_SIZE : sb->capacity;
+        size_t room = cap - s->size;
+        int n = vsnprintf(s->cstr + s->size, room, fmt, ap);
+        if (n >= 0 && (size_t) n >= room)
+            vsnprintf(buffer_reserve(sb, n), n + 1, fmt, aq);
+        va_end(aq);
+        va_end(ap);
+        return buffer_commit(sb, n < 0 ? 0 : n);
+    }
+
+    for (const char *p = fmt; *p; p++) {
+        const char *q = strchr(p, '%');
+        if (!q)
+            q = p + strlen(p);
+        if (q != p)
+            buffer_append(sb, p, q - p);
+        if (!*q)
+            break;
+
+        char tmp[48], *end = tmp + sizeof(tmp), *s = end;
+        int prec = 6, lng = 0, half = 0;
+        p = q + 1;
+        if (*p == '.') {
+            prec = p[1] - '0';
+            p += 2;
+        }
+        for (; *p == 'h' || *p == 'l' || *p == 'z'; p++)
+            lng += *p == 'l' ? 1 : *p == 'z' ? 2 : 0, half += *p == 'h';
+
+        switch (*p) {
+        case '%':
+            *--s = '%';
+            break;
+        case 'c':
+            *--s = (char) va_arg(ap, int);
+            break;
+        case 's': {
+            const char *str = va_arg(ap, const char *);
+            if (!str)
+                str = "(null)";
+            buffer_append(sb, str, strlen(str));
+            continue;
+        }
+        case 'd':
+        case 'i': {
+            int64_t v = lng ? va_arg(ap, long long) : va_arg(ap, int);
+            if (half)
+                v = half == 1 ? (short) v : (signed char) v;
+            s = fmt_u64(end, v < 0 ? -(uint64_t) v : (uint64_t) v);
+            if (v < 0)
+                *--s = '-';
+            break;
+        }
+        case 'u':
+        case 'x': {
+            uint64_t v = lng ? va_arg(ap, unsigned long long)
+                             : va_arg(ap, unsigned);
+            if (half)
+                v = half == 1 ? (unsigned short) v : (unsigned char) v;
+            s = *p == 'u' ? fmt_u64(end, v) : fmt_hex(end, v);
+            break;
+        }
+        case 'f': {
+            double v = va_arg(ap, double);
+            int n = fmt_fixed(tmp, v, prec);
+            if (n < 0)
+                n = snprintf(tmp, sizeof(tmp), "%.*f", prec, v);
+            if (n < 0)
+                continue;
+            if ((size_t) n >= sizeof(tmp)) {
+                char *dst = buffer_reserve(sb, n);
+                snprintf(dst, n + 1, "%.*f", prec, v);
+                sb->str->size += n;
+                continue;
+            }
+            s = tmp;
+            end = tmp + n;
+            break;
+        }
+        }
+        buffer_append(sb, s, end - s);
+    }
+    va_end(ap);
+    return buffer_commit(sb, 0);
 }
@@ -7,53 +7,175 @@ enum {
     CSTR_PERMANENT = 1,
     CSTR_INTERNING = 2,
     CSTR_ONSTACK = 4,
+    CSTR_BUILDER = 8, /* growable heap buffer owned by a cstr_buffer */
 };
 
 #define CSTR_INTERNING_SIZE (32)
 #define CSTR_STACK_SIZE (128)
 
+/* Strings from CSTR_INTERNING_SIZE up to below CSTR_MEDIUM_SIZE bytes go to a
+ * second interning tier once cstr_clone() has seen them twice; the first copy
+ * is an ordinary heap string.  Define it as CSTR_INTERNING_SIZE to turn the
+ * tier off.
+ */
+#ifndef CSTR_MEDIUM_SIZE
+#define CSTR_MEDIUM_SIZE (256)
+#endif
+
+/* Seed of the string hash.  Override it at build time to get a different but
+ * still stable hash function.
+ */
+#ifndef CSTR_HASH_SEED
+#define CSTR_HASH_SEED 0x2d358dccaa6c78a5ULL
+#endif
+
+#define __CSTR_LEN(s) (sizeof(s) - 1)
+
 typedef struct __cstr_data {
     char *cstr;
-    uint32_t hash_size;
+    uint32_t hash; /* 0 until computed; never kept for ONSTACK or BUILDER */
+    uint32_t size; /* bytes before the terminating NUL */
     uint16_t type;
-    uint16_t ref;
+    uint16_t ref; /* holders of an interned string */
+    union {
+        uint32_t id;     /* interned: symbol id + 1, 0 until it has one */
+        uint32_t biased; /* heap: references counted by the owner thread */
+    };
 } * cstring;
 
+/* What CSTR_LITERAL leaves in the cstr_literals section: the literal with its
+ * length, and the string that stands for it.  Long literals are never
+ * interned and stand for themselves; the short ones are hashed and interned
+ * in bulk before main() runs.
+ */
+struct __cstr_literal {
+    struct __cstr_data data;
+    cstring str;
+};
+
 typedef struct __cstr_buffer {
     cstring str;
+    size_t capacity; /* bytes after the header when str is a CSTR_BUILDER */
 } cstr_buffer[1];
 
 #define CSTR_S(s) ((s)->str)
 
 #define CSTR_BUFFER(var)                                                      \
     char var##_cstring[CSTR_STACK_SIZE] = {0};                                \
-    struct __cstr_data var##_cstr_data = {var##_cstring, 0, CSTR_ONSTACK, 0}; \
+    struct __cstr_data var##_cstr_data = {.cstr = var##_cstring,              \
+                                          .type = CSTR_ONSTACK};              \
     cstr_buffer var;                                                          \
-    var->str = &var##_cstr_data;
-
-#define CSTR_LITERAL(var, cstr)                                               \
-    static cstring var = NULL;                                                \
-    if (!var) {                                                               \
-        cstring tmp = cstr_clone("" cstr, (sizeof(cstr) / sizeof(char)) - 1); \
-        if (tmp->type == 0) {                                                 \
-            tmp->type = CSTR_PERMANENT;                                       \
-            tmp->ref = 0;                                                     \
-        }                                                                     \
-        if (!__sync_bool_compare_and_swap(&var, NULL, tmp)) {                 \
-            if (tmp->type == CSTR_PERMANENT)                                  \
-                free(tmp);                                                    \
-        }                                                                     \
-    }
-
-#define CSTR_CLOSE(var)               \
-    do {                              \
-        if (!(var)->str->type)        \
-            cstr_release((var)->str); \
+    var->str = &var##_cstr_data;                                              \
+    var->capacity = 0;
+
+#define CSTR_LITERAL(var, lit)                                                \
+    static struct __cstr_literal var##_literal                                \
+        __attribute__((section("cstr_literals"), used)) = {                    \
+            .data = {.cstr = (char *) ("" lit),                               \
+                     .size = __CSTR_LEN(lit),                                 \
+                     .type = CSTR_PERMANENT},                                 \
+            .str = __CSTR_LEN(lit) < CSTR_INTERNING_SIZE                      \
+                       ? NULL                                                 \
+                       : &var##_literal.data,                                 \
+    };                                                                        \
+    cstring var = __atomic_load_n(&var##_literal.str, __ATOMIC_ACQUIRE);      \
+    if (__builtin_expect(!var, 0))                                            \
+        var = cstr_literal(&var##_literal);
+
+#define CSTR_CLOSE(var)                       \
+    do {                                      \
+        if ((var)->str->type != CSTR_ONSTACK) \
+            cstr_release((var)->str);         \
     } while (0)
 
 /* Public API */
 cstring cstr_grab(cstring s);
+/* the slow path of CSTR_LITERAL, for literals used before main() */
+cstring cstr_literal(struct __cstr_literal *lit);
 cstring cstr_clone(const char *cstr, size_t sz);
+/* out[i] = cstr_clone(s[i], len[i]) for i < n, with the interning of short
+ * strings batched under one lock acquisition and pipelined.
+ */
+void cstr_clone_batch(const char **s, size_t *len, cstring *out, size_t n);
 cstring cstr_cat(cstr_buffer sb, const char *str);
+/* printf-style append, formatted in place in the buffer */
+cstring cstr_catf(cstr_buffer sb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
 int cstr_equal(cstring a, cstring b);
 void cstr_release(cstring s);
+
+/* Opt-in reclamation of interned strings.  Once enabled, each interned
+ * cstring from cstr_clone(), cstr_cat() or cstr_grab() carries a reference
+ * that cstr_release() drops, and cstr_reclaim() frees the entries nobody
+ * holds in the next part of the tables and returns how many it freed; calling
+ * it repeatedly covers them all.  Live strings keep their address, so
+ * interned strings still compare by pointer.  Enabling fails with -1 once
+ * anything but CSTR_LITERAL strings has been interned.
+ */
+int cstr_reclaim_enable(void);
+size_t cstr_reclaim(void);
+
+/* Dense 32-bit symbol ids.  cstr_intern_id() interns s whatever its length
+ * and returns its id, handing out 0, 1, 2, ... in order of first request;
+ * cstr_id_str() maps an id back to the interned string, or to NULL if no
+ * string has it yet.  Strings with an id are never reclaimed.
+ */
+uint32_t cstr_intern_id(cstring s);
+cstring cstr_id_str(uint32_t id);
+
+/* Persisted interning tables.  cstr_snapshot_save() writes every interned
+ * string to a file that cstr_snapshot_load() maps in one go, in O(1), as a
+ * read-only layer under the table: its strings count as interned, stay
+ * pinned, and are only paged in when a lookup touches them.  Strings interned
+ * before the load shadow their copies in the snapshot, so load it first
+ * thing.  One snapshot per process; the file is trusted beyond its header.
+ * Both return 0 on success and -1 on failure.
+ */
+int cstr_snapshot_save(const char *path);
+int cstr_snapshot_load(const char *path);
+
+/* The hash cstr uses for interning and equality, never 0 */
+uint32_t cstr_hash_bytes(const char *s, size_t len);
+
+/* Counters are kept per thread and summed over every thread that ever used
+ * cstr; the table figures are a snapshot taken under the interning lock.
+ */
+struct cstr_stats {
+    size_t intern_hit;  /* table lookups that found the string */
+    size_t intern_miss; /* table lookups that inserted it */
+    size_t cache_hit;   /* served by the per-thread cache */
+    size_t cache_miss;
+    size_t reclaimed;
+
+    size_t size;     /* slots */
+    size_t total;    /* interned strings, not counting the snapshot */
+    size_t snapshot; /* strings in the loaded snapshot */
+    size_t ids;      /* symbol ids handed out */
+    double load;
+    size_t chain_max; /* probe groups to reach an entry, over a sample */
+    double chain_avg;
+    size_t table_bytes; /* control bytes and slots of both tiers */
+
+    size_t medium;            /* strings in the medium tier */
+    size_t medium_slab_bytes; /* allocated to its arena */
+    size_t medium_deferred;   /* heap copies of medium strings seen once */
+
+    size_t slabs;      /* arena slabs */
+    size_t slab_bytes; /* allocated to slabs */
+    size_t slab_used;  /* handed out to strings, padding included */
+    size_t padding;    /* lost to alignment and to slab tails */
+
+    size_t expands;
+    double expand_seconds; /* growing and migrating the table */
+
+    size_t lock_acquire;
+    size_t lock_spin; /* pause iterations waiting for the lock */
+    size_t lock_sleep;
+
+    /* strings produced by cstr_clone() and cstr_cat() */
+    size_t alloc_heap;
+    size_t alloc_intern;
+    size_t alloc_stack;
+};
+
+void cstr_stats(struct cstr_stats *st);
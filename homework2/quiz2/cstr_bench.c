@@ -0,0 +1,305 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cstr.h"
+
+/* Throughput and latency of cstr under concurrency.  Every thread runs
+ * iterations that each pick a key, from a corpus interned up front with
+ * Zipfian popularity or, for the configured share of misses, a key nobody
+ * has seen, and then time:
+ *
+ *   clone         cstr_clone() of the key
+ *   equal         cstr_equal() of the clone against a buffer holding the key
+ *   cat           cstr_cat() of the key into a fresh CSTR_BUFFER
+ *   grab+release  cstr_grab() and cstr_release() of the clone
+ *
+ *   ./cstr_bench -t 8 -k 1000000 -s 1.1 -r 0.95
+ */
+
+#define MAX_KEY 300
+
+enum { OP_CLONE, OP_EQUAL, OP_CAT, OP_GRAB, OPS };
+
+static const char *op_name[OPS] = {"clone", "equal", "cat", "grab+release"};
+
+static struct {
+    int threads;
+    size_t iters; /* per thread */
+    size_t keys;
+    double zipf;
+    double hit; /* share of iterations on corpus keys */
+    int max_len;
+} conf = {4, 200000, 100000, 0.99, 0.9, 64};
+
+static char **corpus;
+static double *cdf; /* cdf[i]: probability of drawing key i or a hotter one */
+
+static pthread_barrier_t start;
+
+struct worker {
+    pthread_t thread;
+    int id;
+    uint64_t rng;
+    uint32_t *lat[OPS]; /* ns, one per iteration */
+    volatile int sink;
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static inline uint64_t rnd(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DULL;
+}
+
+static inline double rnd_unit(uint64_t *s)
+{
+    return (rnd(s) >> 11) * 0x1p-53;
+}
+
+static size_t zipf_draw(uint64_t *s)
+{
+    double u = rnd_unit(s);
+    size_t lo = 0, hi = conf.keys - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* a key of 8 to max_len bytes whose prefix makes it unique */
+static int make_key(char *buf, uint64_t *s, const char *tag, size_t n)
+{
+    int len = snprintf(buf, MAX_KEY + 1, "%s%zx/", tag, n);
+    int want = 8 + rnd(s) % (conf.max_len - 7);
+    while (len < want)
+        buf[len++] = 'a' + rnd(s) % 26;
+    buf[len] = 0;
+    return len;
+}
+
+static void build_corpus(void)
+{
+    uint64_t s = 0x9E3779B97F4A7C15ULL;
+    char buf[MAX_KEY + 1];
+    double sum = 0;
+
+    corpus = malloc(sizeof(char *) * conf.keys);
+    cdf = malloc(sizeof(double) * conf.keys);
+    if (!corpus || !cdf)
+        exit(-1);
+    for (size_t i = 0; i < conf.keys; i++) {
+        make_key(buf, &s, "k", i);
+        corpus[i] = strdup(buf);
+        sum += 1 / pow(i + 1, conf.zipf);
+        cdf[i] = sum;
+    }
+    for (size_t i = 0; i < conf.keys; i++)
+        cdf[i] /= sum;
+
+    /* cstr_intern_id() interns whatever the length and the doorkeeper */
+    for (size_t i = 0; i < conf.keys; i++) {
+        CSTR_BUFFER(b);
+        cstr_cat(b, corpus[i]);
+        cstr_intern_id(CSTR_S(b));
+        CSTR_CLOSE(b);
+    }
+}
+
+static void free_corpus(void)
+{
+    for (size_t i = 0; i < conf.keys; i++)
+        free(corpus[i]);
+    free(corpus);
+    free(cdf);
+}
+
+/* share of the lookups cstr_clone() served from the tables or the cache */
+static double table_hits(const struct cstr_stats *a, const struct cstr_stats *b)
+{
+    size_t hit = b->cache_hit - a->cache_hit + b->intern_hit - a->intern_hit;
+    size_t miss = b->intern_miss - a->intern_miss + b->medium_deferred -
+                  a->medium_deferred;
+    return hit + miss ? (double) hit / (hit + miss) : 0;
+}
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    char miss[MAX_KEY + 1], tag[16];
+
+    snprintf(tag, sizeof(tag), "m%d.", w->id);
+    pthread_barrier_wait(&start);
+    for (size_t i = 0; i < conf.iters; i++) {
+        const char *key;
+        size_t len;
+        if (rnd_unit(&w->rng) < conf.hit) {
+            key = corpus[zipf_draw(&w->rng)];
+            len = strlen(key);
+        } else {
+            len = make_key(miss, &w->rng, tag, i);
+            key = miss;
+        }
+
+        uint64_t t0 = now_ns();
+        cstring s = cstr_clone(key, len);
+        uint64_t t1 = now_ns();
+
+        CSTR_BUFFER(b);
+        cstr_cat(b, key);
+        uint64_t t2 = now_ns();
+
+        w->sink += cstr_equal(s, CSTR_S(b));
+        uint64_t t3 = now_ns();
+
+        cstring g = cstr_grab(s);
+        cstr_release(g);
+        uint64_t t4 = now_ns();
+
+        CSTR_CLOSE(b);
+        cstr_release(s);
+
+        w->lat[OP_CLONE][i] = t1 - t0;
+        w->lat[OP_CAT][i] = t2 - t1;
+        w->lat[OP_EQUAL][i] = t3 - t2;
+        w->lat[OP_GRAB][i] = t4 - t3;
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-t threads] [-n iterations per thread] [-k keys]\n"
+            "       [-s zipf exponent] [-r hit ratio] [-l max key length]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "t:n:k:s:r:l:")) != -1) {
+        switch (c) {
+        case 't':
+            conf.threads = atoi(optarg);
+            break;
+        case 'n':
+            conf.iters = strtoul(optarg, NULL, 0);
+            break;
+        case 'k':
+            conf.keys = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            conf.zipf = atof(optarg);
+            break;
+        case 'r':
+            conf.hit = atof(optarg);
+            break;
+        case 'l':
+            conf.max_len = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (conf.threads < 1 || !conf.iters || !conf.keys || conf.hit < 0 ||
+        conf.hit > 1 || conf.max_len < 24 || conf.max_len > MAX_KEY)
+        usage(argv[0]);
+
+    build_corpus();
+    struct cstr_stats before;
+    cstr_stats(&before);
+
+    struct worker *w = calloc(conf.threads, sizeof(*w));
+    if (!w)
+        exit(-1);
+    pthread_barrier_init(&start, NULL, conf.threads + 1);
+    for (int i = 0; i < conf.threads; i++) {
+        w[i].id = i;
+        w[i].rng = 0x2545F4914F6CDD1DULL * (i + 1);
+        for (int op = 0; op < OPS; op++) {
+            w[i].lat[op] = malloc(sizeof(uint32_t) * conf.iters);
+            if (!w[i].lat[op])
+                exit(-1);
+        }
+        pthread_create(&w[i].thread, NULL, work, &w[i]);
+    }
+    pthread_barrier_wait(&start);
+    uint64_t t = now_ns();
+    for (int i = 0; i < conf.threads; i++)
+        pthread_join(w[i].thread, NULL);
+    t = now_ns() - t;
+
+    size_t n = conf.threads * conf.iters;
+    printf("%d threads, %zu iterations each, %zu keys (zipf %.2f), "
+           "hit ratio %.2f, keys up to %d bytes\n\n",
+           conf.threads, conf.iters, conf.keys, conf.zipf, conf.hit,
+           conf.max_len);
+    printf("%.0f iterations/s, %.0f ops/s\n\n", n * 1e9 / t,
+           n * (OPS + 1) * 1e9 / t); /* grab+release is two */
+
+    uint32_t *all = malloc(sizeof(uint32_t) * n);
+    if (!all)
+        exit(-1);
+    printf("%-14s %8s %8s %8s %8s %8s  (ns)\n", "op", "p50", "p90", "p99",
+           "p99.9", "max");
+    for (int op = 0; op < OPS; op++) {
+        for (int i = 0; i < conf.threads; i++)
+            memcpy(all + i * conf.iters, w[i].lat[op],
+                   sizeof(uint32_t) * conf.iters);
+        qsort(all, n, sizeof(uint32_t), cmp_u32);
+        printf("%-14s %8u %8u %8u %8u %8u\n", op_name[op], all[n / 2],
+               all[n * 9 / 10], all[n * 99 / 100], all[n * 999 / 1000],
+               all[n - 1]);
+    }
+    free(all);
+
+    struct cstr_stats st;
+    cstr_stats(&st);
+    size_t uniq = st.total + st.medium;
+    size_t bytes = st.slab_bytes + st.medium_slab_bytes + st.table_bytes;
+    printf("\n%zu interned strings (%zu short, %zu medium), %zu heap\n", uniq,
+           st.total, st.medium, st.alloc_heap);
+    printf("%zu bytes in arenas and tables, %.1f per interned string\n", bytes,
+           uniq ? (double) bytes / uniq : 0);
+    printf("cache hits %.1f%%, lock acquisitions %zu, %zu slept\n",
+           st.cache_hit + st.cache_miss
+               ? 100.0 * st.cache_hit / (st.cache_hit + st.cache_miss)
+               : 0,
+           st.lock_acquire, st.lock_sleep);
+    printf("table hit ratio %.1f%% (%.1f%% of draws from the corpus)\n",
+           100 * table_hits(&before, &st), 100 * conf.hit);
+
+    for (int i = 0; i < conf.threads; i++) {
+        for (int op = 0; op < OPS; op++)
+            free(w[i].lat[op]);
+    }
+    free(w);
+    pthread_barrier_destroy(&start);
+    free_corpus();
+    return 0;
+}
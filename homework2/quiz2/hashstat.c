@@ -0,0 +1,175 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cstr.h"
+
+/* Report how well the cstr hash spreads a real corpus, one key per line, read
+ * from the files given on the command line or from stdin.  The keys are
+ * deduplicated, hashed with the previous byte-at-a-time hash and with the
+ * current one, and each hash is timed and dropped into a chained table with a
+ * power-of-2 bucket count at the 80% load the old interning table ran at.
+ *
+ *   ./hashstat /usr/share/dict/words
+ */
+
+#define LOAD_NUM 4 /* 80% (4/5) load */
+#define LOAD_DEN 5
+#define HIST_MAX 8 /* last histogram row counts chains of HIST_MAX or more */
+#define TIME_ROUNDS 16
+
+struct key {
+    const char *s;
+    size_t len;
+};
+
+/* hash_blob from before the word-at-a-time hash */
+static uint32_t legacy_hash(const char *buffer, size_t len)
+{
+    const uint8_t *ptr = (const uint8_t *) buffer;
+    size_t h = len;
+    size_t step = (len >> 5) + 1;
+    for (size_t i = len; i >= step; i -= step)
+        h = h ^ ((h << 5) + (h >> 2) + ptr[i - 1]);
+    return h == 0 ? 1 : h;
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+    const struct key *x = a, *y = b;
+    size_t n = x->len < y->len ? x->len : y->len;
+    int r = memcmp(x->s, y->s, n);
+    return r ? r : (x->len > y->len) - (x->len < y->len);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void read_keys(FILE *f, struct key **keys, size_t *n, size_t *cap)
+{
+    char *line = NULL;
+    size_t sz = 0;
+    ssize_t len;
+    while ((len = getline(&line, &sz, f)) != -1) {
+        if (len && line[len - 1] == '\n')
+            line[--len] = 0;
+        if (*n == *cap) {
+            *cap = *cap ? *cap * 2 : 1024;
+            *keys = realloc(*keys, sizeof(struct key) * *cap);
+            if (!*keys)
+                exit(-1);
+        }
+        (*keys)[*n].s = strdup(line);
+        (*keys)[(*n)++].len = len;
+    }
+    free(line);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name,
+                   uint32_t (*hash)(const char *, size_t),
+                   const struct key *keys,
+                   size_t n)
+{
+    uint32_t *h = malloc(sizeof(uint32_t) * n);
+    volatile uint32_t sink = 0;
+    double t = now();
+    for (int r = 0; r < TIME_ROUNDS; r++) {
+        for (size_t i = 0; i < n; i++)
+            sink += hash(keys[i].s, keys[i].len);
+    }
+    t = now() - t;
+    for (size_t i = 0; i < n; i++)
+        h[i] = hash(keys[i].s, keys[i].len);
+
+    size_t buckets = 1;
+    while (buckets * LOAD_NUM < n * LOAD_DEN)
+        buckets <<= 1;
+    unsigned *chain = calloc(buckets, sizeof(unsigned));
+    for (size_t i = 0; i < n; i++)
+        chain[h[i] & (buckets - 1)]++;
+
+    size_t hist[HIST_MAX + 1] = {0}, longest = 0, probes = 0;
+    for (size_t b = 0; b < buckets; b++) {
+        hist[chain[b] < HIST_MAX ? chain[b] : HIST_MAX]++;
+        if (chain[b] > longest)
+            longest = chain[b];
+        /* a successful lookup walks to the key's position in its chain */
+        probes += (size_t) chain[b] * (chain[b] + 1) / 2;
+    }
+
+    qsort(h, n, sizeof(uint32_t), cmp_u32);
+    size_t collisions = 0;
+    for (size_t i = 1; i < n; i++)
+        collisions += h[i] == h[i - 1];
+
+    double lambda = (double) n / buckets, poisson = exp(-lambda);
+    printf("%s\n", name);
+    printf("  %.2f ns/key, %zu full 32-bit collisions (%.1f expected)\n",
+           t * 1e9 / ((double) n * TIME_ROUNDS), collisions,
+           (double) n * (n - 1) / 2 / 4294967296.0);
+    printf("  %zu buckets, longest chain %zu, %.3f probes per hit\n",
+           buckets, longest, (double) probes / n);
+    printf("  chain  buckets  expected\n");
+    for (int c = 0; c <= HIST_MAX; c++) {
+        double expect = c < HIST_MAX ? poisson : 0;
+        if (c == HIST_MAX) {
+            double below = 0, p = exp(-lambda);
+            for (int k = 0; k < HIST_MAX; k++, p *= lambda / k)
+                below += p;
+            expect = 1 - below;
+        }
+        printf("  %s%-4d %8zu  %8.0f\n", c == HIST_MAX ? ">=" : "  ", c,
+               hist[c], expect * buckets);
+        poisson *= lambda / (c + 1);
+    }
+
+    free(chain);
+    free(h);
+}
+
+int main(int argc, char *argv[])
+{
+    struct key *keys = NULL;
+    size_t n = 0, cap = 0;
+
+    if (argc < 2)
+        read_keys(stdin, &keys, &n, &cap);
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "r");
+        if (!f) {
+            perror(argv[i]);
+            return 1;
+        }
+        read_keys(f, &keys, &n, &cap);
+        fclose(f);
+    }
+
+    qsort(keys, n, sizeof(struct key), cmp_key);
+    size_t uniq = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!uniq || cmp_key(&keys[uniq - 1], &keys[i]))
+            keys[uniq++] = keys[i];
+    }
+    if (!uniq) {
+        fprintf(stderr, "no keys\n");
+        return 1;
+    }
+    printf("%zu keys, %zu unique\n\n", n, uniq);
+
+    report("legacy shift/xor hash", legacy_hash, keys, uniq);
+    printf("\n");
+    report("cstr_hash_bytes", cstr_hash_bytes, keys, uniq);
+    return 0;
+}
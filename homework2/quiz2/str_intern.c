@@ -1,4 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "cstr.h"
 
@@ -21,8 +24,128 @@ static void test_cstr()
     cstr_release(b);
 }
 
+static void test_batch()
+{
+    const char *s[] = {"alpha", "beta", "alpha",
+                       "a string long enough to be medium"};
+    size_t len[4];
+    cstring out[4];
+    for (int i = 0; i < 4; i++)
+        len[i] = strlen(s[i]);
+    cstr_clone_batch(s, len, out, 4);
+    cstring a = cstr_clone("alpha", 5);
+    int ok = out[0] == out[2] && out[0] == a && !strcmp(out[3]->cstr, s[3]);
+    printf("batch %s\n", ok ? "equal" : "not equal");
+    cstr_release(a);
+    for (int i = 0; i < 4; i++)
+        cstr_release(out[i]);
+}
+
+/* must come first: reclamation is only enabled on an empty table */
+static void test_reclaim()
+{
+    if (cstr_reclaim_enable()) {
+        printf("reclaim not enabled\n");
+        return;
+    }
+    cstring held = cstr_clone("held", 4);
+    cstr_release(cstr_clone("dropped", 7));
+    size_t n = cstr_reclaim();
+    cstring again = cstr_clone("held", 4);
+    printf("reclaim %s\n", n && again == held ? "equal" : "not equal");
+    cstr_release(again);
+    cstr_release(held);
+}
+
+static void test_catf()
+{
+    CSTR_BUFFER(a);
+    cstr_catf(a, "%s %d|%5.2f|%x|%c", "catf", -42, 3.14159, 255u, '!');
+    CSTR_LITERAL(want, "catf -42| 3.14|ff|!");
+    int ok = cstr_equal(CSTR_S(a), want);
+    CSTR_CLOSE(a);
+
+    /* No width, so these take the fast float path, which leaves values
+     * near a rounding tie to snprintf().
+     */
+    static const struct {
+        const char *fmt;
+        double v;
+    } f[] = {
+        {"%.2f", 9.996},   {"%.2f", -0.996},    {"%f", 0.9999996},
+        {"%f", 3.14159},   {"%f", -0.0001},     {"%.3f", 1e9},
+        {"%f", 0},         {"%.2f", 9.995},     {"%.0f", 2.5},
+    };
+    for (size_t i = 0; i < sizeof(f) / sizeof(f[0]); i++) {
+        char ref[64];
+        CSTR_BUFFER(b);
+        cstr_catf(b, f[i].fmt, f[i].v);
+        snprintf(ref, sizeof(ref), f[i].fmt, f[i].v);
+        if (strcmp(CSTR_S(b)->cstr, ref)) {
+            printf("catf %s: %s, not %s\n", f[i].fmt, CSTR_S(b)->cstr, ref);
+            ok = 0;
+        }
+        CSTR_CLOSE(b);
+    }
+    printf("catf %s\n", ok ? "equal" : "not equal");
+}
+
+static void test_ids()
+{
+    CSTR_BUFFER(a);
+    cstr_cat(a, "a symbol longer than the short strings");
+    uint32_t id = cstr_intern_id(CSTR_S(a));
+    cstring s = cstr_id_str(id);
+    int ok = s && cstr_equal(s, CSTR_S(a)) &&
+             cstr_intern_id(cstr_id_str(id)) == id && !cstr_id_str(id + 1);
+    printf("ids %s\n", ok ? "equal" : "not equal");
+
+    /* longer than the first arena slab */
+    size_t n = 200000;
+    char *p = malloc(n);
+    if (!p)
+        goto out;
+    memset(p, 'x', n);
+    cstring big = cstr_clone(p, n);
+    uint32_t big_id = cstr_intern_id(big);
+    s = cstr_id_str(big_id);
+    ok = s && s->size == n && !memcmp(s->cstr, p, n) &&
+         cstr_id_str(cstr_intern_id(CSTR_S(a))) != s;
+    printf("long ids %s\n", ok ? "equal" : "not equal");
+    cstr_release(big);
+    free(p);
+out:
+    CSTR_CLOSE(a);
+}
+
+/* last: the snapshot is loaded under everything interned so far */
+static void test_snapshot()
+{
+    char path[] = "/tmp/str_intern.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return;
+    close(fd);
+
+    cstring s = cstr_clone("saved", 5);
+    int ok = !cstr_snapshot_save(path) && !cstr_snapshot_load(path);
+    struct cstr_stats st;
+    cstr_stats(&st);
+    cstring again = cstr_clone("saved", 5);
+    printf("snapshot %s\n",
+           ok && st.snapshot && again == s ? "equal" : "not equal");
+    cstr_release(again);
+    cstr_release(s);
+    unlink(path);
+}
+
 int main(int argc, char *argv[])
 {
+    test_reclaim();
+    test_batch();
+    test_catf();
     test_cstr();
+    test_ids();
+    test_snapshot();
     return 0;
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -7,12 +8,19 @@
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #define MAX_STR_LEN_BITS (54)
 #define MAX_STR_LEN ((1UL << MAX_STR_LEN_BITS) - 1)
 
 #define STACK_SIZE 15
 #define LARGE_STRING_LEN 256
 
+#define VIEW_BITS (30)
+#define VIEW_MAX ((1UL << VIEW_BITS) - 1)
+
 typedef union {
     /* allow strings up to 15 bytes to stay on the stack
      * use the last byte as a null terminator and to store flags
@@ -40,8 +48,40 @@ typedef union {
                       capacity : 6;
         /* the last 4 bits are important flags */
     };
+
+    /* view into part of a heap string, with flag3 set.  It holds a
+     * reference to the buffer, and where the span starts is counted from
+     * the end of the header.
+     */
+    struct {
+        char *filler_ptr;
+        size_t view_size : VIEW_BITS, view_offset : VIEW_BITS;
+    };
 } xs;
 
+/* Every heap string starts with this header.  The data follows it after
+ * front bytes of slack left for prepends.  Copies share large strings and
+ * views share any heap string, so refcnt stays 1 for a medium string until
+ * it is sliced.  The count is atomic so that the holders can live in
+ * different threads; front only changes while the count is 1.
+ */
+struct xs_header {
+    atomic_uint refcnt;
+    uint32_t front;
+};
+
+#define XS_HEADER_SIZE sizeof(struct xs_header)
+
+static inline struct xs_header *xs_header(const xs *x)
+{
+    return (struct xs_header *) x->ptr;
+}
+
+static inline size_t xs_front(const xs *x)
+{
+    return xs_header(x)->front;
+}
+
 static inline bool xs_is_ptr(const xs *x) { return x->is_ptr; }
 
 static inline bool xs_is_large_string(const xs *x)
@@ -49,15 +89,25 @@ static inline bool xs_is_large_string(const xs *x)
     return x->is_large_string;
 }
 
+/* A view is not NUL-terminated: use xs_size() with xs_data() */
+static inline bool xs_is_view(const xs *x)
+{
+    return xs_is_ptr(x) && x->flag3;
+}
+
 static inline size_t xs_size(const xs *x)
 {
-    return xs_is_ptr(x) ? x->size : STACK_SIZE - x->space_left;
+    if (!xs_is_ptr(x))
+        return STACK_SIZE - x->space_left;
+    return xs_is_view(x) ? x->view_size : x->size;
 }
 
 static inline void xs_set_size(xs *x, size_t s)
 {
     if (!xs_is_ptr(x))
         x->space_left = STACK_SIZE - s;
+    else if (xs_is_view(x))
+        x->view_size = s;
     else
         x->size = s;
 }
@@ -66,47 +116,73 @@ static inline char *xs_data(const xs *x)
 {
     if (!xs_is_ptr(x))
         return (char *) x->data;
-    else if (xs_is_large_string(x))
-        return (char *) (x->ptr + 4);
-    else 
-        return (char *) x->ptr;
+    else if (xs_is_view(x))
+        return x->ptr + XS_HEADER_SIZE + x->view_offset;
+    else
+        return x->ptr + XS_HEADER_SIZE + xs_front(x);
 }
 
+/* bytes the string can grow to at its end, not counting the terminator */
 static inline size_t xs_capacity(const xs *x)
 {
-    return xs_is_ptr(x) ? ((size_t) 1UL << x->capacity) - 1 : 15;
+    if (!xs_is_ptr(x))
+        return 15;
+    if (xs_is_view(x))
+        return x->view_size;
+    return ((size_t) 1UL << x->capacity) - 1 - xs_front(x);
 }
 
 static inline void xs_set_refcnt(const xs *x, int val)
 {
-    *((int *) x->ptr) = val;
+    atomic_store_explicit(&xs_header(x)->refcnt, val, memory_order_relaxed);
 }
 
+/* A new reference comes from one already held, which orders it, so the
+ * increment needs no ordering of its own.
+ */
 static inline void xs_inc_refcnt(const xs *x)
 {
-    if (xs_is_large_string(x))
-        ++(*(int *) x->ptr);
+    if (xs_is_ptr(x))
+        atomic_fetch_add_explicit(&xs_header(x)->refcnt, 1,
+                                  memory_order_relaxed);
 }
 
+/* Release makes our writes visible to whoever frees the buffer and acquire
+ * makes theirs visible to us.  A count of 1 is ours alone and nobody can
+ * raise it, so the sole owner skips the atomic read-modify-write.
+ */
 static inline int xs_dec_refcnt(const xs *x)
 {
-    if (!xs_is_large_string(x))
+    if (!xs_is_ptr(x))
         return 0;
-    return --(*(int *) x->ptr);
+    atomic_uint *refcnt = &xs_header(x)->refcnt;
+    if (atomic_load_explicit(refcnt, memory_order_acquire) == 1)
+        return 0;
+    return atomic_fetch_sub_explicit(refcnt, 1, memory_order_acq_rel) - 1;
 }
 
+/* Acquire pairs with the release in xs_dec_refcnt(): once a count of 1 is
+ * seen, the other holders are done with the buffer and it may be written.
+ */
 static inline int xs_get_refcnt(const xs *x)
 {
-    if (!xs_is_large_string(x))
+    if (!xs_is_ptr(x))
         return 0;
-    return *(int *) x->ptr;
+    atomic_uint *refcnt = &xs_header(x)->refcnt;
+    return atomic_load_explicit(refcnt, memory_order_acquire);
+}
+
+/* a view or a buffer with other holders is copied before it is written */
+static inline bool xs_is_shared(const xs *x)
+{
+    return xs_is_view(x) || xs_get_refcnt(x) > 1;
 }
 
 #define xs_literal_empty() \
     (xs) { .data[0] = '\0', .space_left = 15, .is_ptr = 0, .is_large_string = 0 }
 
 /* lowerbound (floor log2) */
-static inline int ilog2(uint32_t n) { return 32 - __builtin_clz(n) - 1; }
+static inline int ilog2(size_t n) { return 64 - __builtin_clzl(n) - 1; }
 
 static inline xs *xs_newempty(xs *x)
 {
@@ -126,21 +202,19 @@ static inline xs *xs_free(xs *x)
  */
 static void xs_allocate(xs *x, size_t len)
 {
-    x->capacity = ilog2(len) + 1;
     xs_free(x);
+    if (len <= STACK_SIZE)
+        return;
 
-    if (len >= LARGE_STRING_LEN) {
-        /* Large string */
-        x->is_large_string = 1;
-        /* The extra 4 bytes are used to store the reference count */
-        x->ptr = malloc((size_t)(1UL << x->capacity) + 4);
-        x->is_ptr = 1;
-        xs_set_refcnt(x, 1);
-    } else if (len > STACK_SIZE) {
-        /* Medium string */
-        x->ptr = malloc((size_t) 1UL << x->capacity);
-        x->is_ptr = 1;
-    }
+    /* Medium and large strings share the header, so a medium string that
+     * grows large keeps its buffer and its reference count.
+     */
+    x->capacity = ilog2(len) + 1;
+    x->ptr = malloc(XS_HEADER_SIZE + ((size_t) 1UL << x->capacity));
+    x->is_ptr = 1;
+    x->is_large_string = len >= LARGE_STRING_LEN;
+    xs_set_refcnt(x, 1);
+    xs_header(x)->front = 0;
 }
 
 xs *xs_new(xs *x, const void *p)
@@ -162,31 +236,73 @@ xs *xs_new(xs *x, const void *p)
      }){1}),                                                        \
      xs_new(&xs_literal_empty(), x))
 
+/* Move x into a buffer of its own with front bytes of slack and room for
+ * len bytes after them.
+ */
+static void xs_move(xs *x, size_t front, size_t len)
+{
+    size_t size = xs_size(x);
+    xs tmp = xs_literal_empty();
+
+    xs_allocate(&tmp, front + len);
+    if (front)
+        xs_header(&tmp)->front = front;
+    memcpy(xs_data(&tmp), xs_data(x), size);
+    xs_data(&tmp)[size] = 0;
+    xs_set_size(&tmp, size);
+    xs_free(x);
+    *x = tmp;
+}
+
 /* grow up to specified size */
 xs *xs_grow(xs *x, size_t len)
 {
-    char buf[16];
-    char *backup, *f = NULL;
+    size_t size = xs_size(x);
 
+    if (len < size)
+        len = size;
+    if (xs_is_shared(x)) {
+        xs_move(x, 0, len);
+        return x;
+    }
     if (len <= xs_capacity(x))
         return x;
 
-    /* Backup first */
-    if (xs_is_ptr(x)) {
-        backup = xs_data(x);
-        f = x->ptr;
-        x->is_ptr = 0;
-    } else {
-        memcpy(buf, x->data, 16);
-        backup = (char *) &buf;
+    if (!xs_is_ptr(x)) {
+        xs_move(x, 0, len);
+        return x;
     }
 
-    xs_allocate(x, len);
-    memcpy(xs_data(x), backup, xs_size(x));
+    /* The buffer is ours, so realloc keeps the content and the front slack
+     * in place and can often extend it without copying.  Rounding up to a
+     * power of 2 makes repeated appends amortized O(1).
+     */
+    size_t front = xs_front(x);
+    x->capacity = ilog2(front + len) + 1;
+    x->ptr = realloc(x->ptr, XS_HEADER_SIZE + ((size_t) 1UL << x->capacity));
+    if (front + len >= LARGE_STRING_LEN)
+        x->is_large_string = 1;
+    return x;
+}
 
-    if (f)
-        free(f);
+/* Make room to prepend front bytes and append back bytes without another
+ * allocation.  Front slack needs a heap buffer, so a short string asking for
+ * it leaves the stack.
+ */
+xs *xs_reserve(xs *x, size_t front, size_t back)
+{
+    size_t size = xs_size(x);
+
+    if (!front)
+        return xs_grow(x, size + back);
+    if (xs_is_ptr(x) && !xs_is_shared(x) && xs_front(x) >= front &&
+        size + back <= xs_capacity(x))
+        return x;
 
+    size_t len = size + back;
+    if (front + len <= STACK_SIZE)
+        len = STACK_SIZE + 1 - front;
+    xs_move(x, front, len);
     return x;
 }
 
@@ -194,62 +310,320 @@ static inline xs *xs_cpy(xs *dest, xs *src)
 {
     xs_free(dest);
     *dest = *src;
-    size_t len = xs_size(src);
-    if (len >= LARGE_STRING_LEN)
+    if (xs_is_large_string(src) || xs_is_view(src))
         xs_inc_refcnt(src);
-    else if (len > STACK_SIZE) {
-        dest->is_ptr = 0;
+    else if (xs_is_ptr(src)) {
+        size_t len = xs_size(src);
+        xs_newempty(dest);
         xs_allocate(dest, len);
         memcpy(xs_data(dest), xs_data(src), len + 1);
+        xs_set_size(dest, len);
     }
     return dest;
 }
 
 static bool xs_cow_lazy_copy(xs *x)
 {
-    if (xs_get_refcnt(x) <= 1)
+    if (!xs_is_shared(x))
         return false;
 
     /* Lazy copy */
+    xs_move(x, 0, xs_size(x));
+    return true;
+}
+
+/* p may point into x itself, so callers that reallocate find it again by its
+ * offset.  Returns -1 for memory outside the string.
+ */
+static inline ptrdiff_t xs_offset(const xs *x, const void *p)
+{
+    uintptr_t off = (uintptr_t) p - (uintptr_t) xs_data(x);
+    return off <= xs_size(x) ? (ptrdiff_t) off : -1;
+}
+
+xs *xs_append(xs *x, const void *p, size_t n)
+{
+    size_t size = xs_size(x);
+    ptrdiff_t self = xs_offset(x, p);
+
+    if (!n)
+        return x;
+    xs_grow(x, size + n);
+    if (self >= 0)
+        p = xs_data(x) + self;
+
     char *data = xs_data(x);
-    xs_dec_refcnt(x);
-    x->is_ptr = 0;
-    xs_allocate(x, xs_size(x));
+    memcpy(data + size, p, n);
+    data[size + n] = 0;
+    xs_set_size(x, size + n);
+    return x;
+}
 
-    memcpy(xs_data(x), data, x->size + 1);
-    return true;
+xs *xs_append_cstr(xs *x, const char *s)
+{
+    return xs_append(x, s, strlen(s));
 }
 
-xs *xs_concat(xs *string, const xs *prefix, const xs *suffix)
+xs *xs_prepend(xs *x, const void *p, size_t n)
 {
-    size_t pres = xs_size(prefix), sufs = xs_size(suffix),
-           size = xs_size(string), capacity = xs_capacity(string);
+    size_t size = xs_size(x);
+    ptrdiff_t self = xs_offset(x, p);
 
-    xs_cow_lazy_copy(string);
-    char *pre = xs_data(prefix), *suf = xs_data(suffix),
-         *data = xs_data(string);
+    if (!n)
+        return x;
+    if (!xs_is_ptr(x) && size + n <= STACK_SIZE) {
+        char buf[STACK_SIZE];
+        memcpy(buf, p, n);
+        memmove(x->data + n, x->data, size + 1);
+        memcpy(x->data, buf, n);
+        xs_set_size(x, size + n);
+        return x;
+    }
 
-    if (size + pres + sufs <= capacity) {
-        memmove(data + pres, data, size);
-        memcpy(data, pre, pres);
-        memcpy(data + pres + size, suf, sufs + 1);
+    if (!xs_is_ptr(x) || xs_is_shared(x) || xs_front(x) < n) {
+        /* Leave as much slack as the result is long, so that repeated
+         * prepends are amortized O(1) like appends.
+         */
+        size_t slack = size + n;
+        if (slack > UINT32_MAX)
+            slack = UINT32_MAX;
+        if (slack < n)
+            slack = n;
+        xs_reserve(x, slack, 0);
+        if (self >= 0)
+            p = xs_data(x) + self;
+    }
+
+    xs_header(x)->front -= n;
+    memcpy(xs_data(x), p, n);
+    x->size = size + n;
+    return x;
+}
 
-        if (xs_is_ptr(string))
-            string->size = size + pres + sufs;
-        else
-            string->space_left = 15 - (size + pres + sufs);
+xs *xs_concat(xs *string, const xs *prefix, const xs *suffix)
+{
+    xs_append(string, xs_data(suffix), xs_size(suffix));
+    return xs_prepend(string, xs_data(prefix), xs_size(prefix));
+}
+
+/* Make dest the len bytes of src from off.  A slice of a heap string is a
+ * view sharing its buffer, so no bytes move until one of them is written.
+ * Slices that fit on the stack, slices of stack strings, and spans a view
+ * cannot address are copied.
+ */
+xs *xs_slice(xs *dest, const xs *src, size_t off, size_t len)
+{
+    size_t size = xs_size(src);
+    xs tmp = xs_literal_empty();
+
+    if (off > size)
+        off = size;
+    if (len > size - off)
+        len = size - off;
+
+    char *data = xs_data(src) + off;
+    size_t start = xs_is_ptr(src) ? data - (src->ptr + XS_HEADER_SIZE) : 0;
+    if (!xs_is_ptr(src) || len <= STACK_SIZE || start + len > VIEW_MAX) {
+        xs_allocate(&tmp, len);
+        memcpy(xs_data(&tmp), data, len);
+        xs_data(&tmp)[len] = 0;
+        xs_set_size(&tmp, len);
     } else {
-        xs tmps = xs_literal_empty();
-        xs_grow(&tmps, size + pres + sufs);
-        char *tmpdata = xs_data(&tmps);
-        memcpy(tmpdata + pres, data, size);
-        memcpy(tmpdata, pre, pres);
-        memcpy(tmpdata + pres + size, suf, sufs + 1);
-        xs_free(string);
-        *string = tmps;
-        string->size = size + pres + sufs;
+        /* take the reference first, in case dest is src */
+        tmp = *src;
+        xs_inc_refcnt(src);
+        tmp.flag3 = 1;
+        tmp.view_offset = start;
+        tmp.view_size = len;
+    }
+    xs_free(dest);
+    *dest = tmp;
+    return dest;
+}
+
+/* Byte set for xs_span(), xs_cspan() and xs_trim().  The bitmap answers
+ * for one byte at a time.  The nibble tables answer for 16 or 32 bytes at
+ * once with two pshufb lookups: every distinct high nibble in the set gets
+ * one of 8 bits, hi[] maps a high nibble to its bit and lo[] a low nibble to
+ * the bits of the high nibbles it pairs with, so c is in the set exactly
+ * when lo[c & 15] & hi[c >> 4] is nonzero.  Sets spanning more than 8 high
+ * nibbles do not fit and stay on the bitmap.
+ */
+struct xs_byteset {
+    uint8_t mask[32];
+    uint8_t lo[16], hi[16];
+    bool nibbles; /* lo[] and hi[] are exact */
+};
+
+static inline bool xs_byteset_has(const struct xs_byteset *set, uint8_t c)
+{
+    return set->mask[c >> 3] & 1 << (c & 7);
+}
+
+static void xs_byteset_init(struct xs_byteset *set, const char *chars)
+{
+    int bits = 0;
+
+    memset(set, 0, sizeof(*set));
+    for (const uint8_t *c = (const uint8_t *) chars; *c; c++)
+        set->mask[*c >> 3] |= 1 << (*c & 7);
+    for (int h = 0; h < 16; h++) {
+        if (!set->mask[2 * h] && !set->mask[2 * h + 1])
+            continue;
+        if (bits == 8)
+            return;
+        set->hi[h] = 1 << bits++;
+        for (int l = 0; l < 16; l++) {
+            if (xs_byteset_has(set, h << 4 | l))
+                set->lo[l] |= set->hi[h];
+        }
+    }
+    set->nibbles = true;
+}
+
+/* Forward, return the index of the first byte whose membership is not in;
+ * backward, one past the last such byte.  n when forward finds none, 0 when
+ * backward does.
+ */
+static size_t xs_scan_bytes(const struct xs_byteset *set,
+                            const uint8_t *p,
+                            size_t n,
+                            bool in,
+                            bool rev)
+{
+    if (!rev) {
+        size_t i = 0;
+        while (i < n && xs_byteset_has(set, p[i]) == in)
+            i++;
+        return i;
     }
-    return string;
+    while (n > 0 && xs_byteset_has(set, p[n - 1]) == in)
+        n--;
+    return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* bit i set when byte i of the block is in the set */
+__attribute__((target("ssse3"))) static inline uint32_t xs_members16(
+    const uint8_t *p,
+    __m128i lo,
+    __m128i hi)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(v, nibble));
+    __m128i h =
+        _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    __m128i out = _mm_cmpeq_epi8(_mm_and_si128(l, h), _mm_setzero_si128());
+    return ~_mm_movemask_epi8(out) & 0xffff;
+}
+
+/* pshufb looks up within each 128-bit lane, so lo and hi hold the tables
+ * twice
+ */
+__attribute__((target("avx2"))) static inline uint32_t xs_members32(
+    const uint8_t *p,
+    __m256i lo,
+    __m256i hi)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+    __m256i h = _mm256_shuffle_epi8(
+        hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    __m256i out =
+        _mm256_cmpeq_epi8(_mm256_and_si256(l, h), _mm256_setzero_si256());
+    return ~(uint32_t) _mm256_movemask_epi8(out);
+}
+
+/* Scan n bytes at p a block of width at a time.  A block stops the scan at
+ * its lowest set bit of members ^ flip going forward, at its highest going
+ * backward, and the bytes left over go one at a time.
+ */
+#define XS_SCAN_BLOCKS(width, members)                                  \
+    do {                                                                \
+        if (!rev) {                                                     \
+            size_t i = 0;                                               \
+            for (; i + width <= n; i += width) {                        \
+                uint32_t stop = members(p + i, lo, hi) ^ flip;          \
+                if (stop)                                               \
+                    return i + __builtin_ctz(stop);                     \
+            }                                                           \
+            return i + xs_scan_bytes(set, p + i, n - i, in, false);     \
+        }                                                               \
+        for (; n >= width; n -= width) {                                \
+            uint32_t stop = members(p + n - width, lo, hi) ^ flip;      \
+            if (stop)                                                   \
+                return n - width + 32 - __builtin_clz(stop);            \
+        }                                                               \
+        return xs_scan_bytes(set, p, n, in, true);                      \
+    } while (0)
+
+__attribute__((target("ssse3"))) static size_t xs_scan_ssse3(
+    const struct xs_byteset *set,
+    const uint8_t *p,
+    size_t n,
+    bool in,
+    bool rev)
+{
+    __m128i lo = _mm_loadu_si128((const __m128i *) set->lo);
+    __m128i hi = _mm_loadu_si128((const __m128i *) set->hi);
+    uint32_t flip = in ? 0xffff : 0;
+    XS_SCAN_BLOCKS(16, xs_members16);
+}
+
+__attribute__((target("avx2"))) static size_t xs_scan_avx2(
+    const struct xs_byteset *set,
+    const uint8_t *p,
+    size_t n,
+    bool in,
+    bool rev)
+{
+    __m256i lo = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *) set->lo));
+    __m256i hi = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *) set->hi));
+    uint32_t flip = in ? 0xffffffff : 0;
+    XS_SCAN_BLOCKS(32, xs_members32);
+}
+#undef XS_SCAN_BLOCKS
+#endif
+
+/* pick the widest scan this CPU runs and the set allows */
+static size_t xs_scan(const struct xs_byteset *set,
+                      const char *s,
+                      size_t n,
+                      bool in,
+                      bool rev)
+{
+    const uint8_t *p = (const uint8_t *) s;
+#if defined(__x86_64__) || defined(__i386__)
+    if (set->nibbles && n >= 16) {
+        if (n >= 32 && __builtin_cpu_supports("avx2"))
+            return xs_scan_avx2(set, p, n, in, rev);
+        if (__builtin_cpu_supports("ssse3"))
+            return xs_scan_ssse3(set, p, n, in, rev);
+    }
+#endif
+    return xs_scan_bytes(set, p, n, in, rev);
+}
+
+/* length of the leading run of x made of bytes in accept, like strspn() */
+size_t xs_span(const xs *x, const char *accept)
+{
+    struct xs_byteset set;
+    xs_byteset_init(&set, accept);
+    return xs_scan(&set, xs_data(x), xs_size(x), true, false);
+}
+
+/* length of the leading run of x made of bytes not in reject, like
+ * strcspn() but it does not stop at NUL
+ */
+size_t xs_cspan(const xs *x, const char *reject)
+{
+    struct xs_byteset set;
+    xs_byteset_init(&set, reject);
+    return xs_scan(&set, xs_data(x), xs_size(x), false, false);
 }
 
 xs *xs_trim(xs *x, const char *trimset)
@@ -257,26 +631,24 @@ xs *xs_trim(xs *x, const char *trimset)
     if (!trimset[0])
         return x;
 
-    xs_cow_lazy_copy(x);
-    char *dataptr = xs_data(x), *orig = dataptr;
+    char *dataptr = xs_data(x), *orig;
 
     /* similar to strspn/strpbrk but it operates on binary data */
-    uint8_t mask[32] = {0};
-
-#define check_bit(i) (mask[(uint8_t) i >> 3] & 1 << ((uint8_t) i & 7))
-#define set_bit(i) (mask[(uint8_t) i >> 3] |= 1 << ((uint8_t) i & 7))
-    size_t i, slen = xs_size(x), trimlen = strlen(trimset);
-
-    for (i = 0; i < trimlen; i++)
-        set_bit(trimset[i]);
-    for (i = 0; i < slen; i++)
-        if (!check_bit(dataptr[i]))
-            break;
-    for (; slen > 0; slen--)
-        if (!check_bit(dataptr[slen - 1]))
-            break;
-    dataptr += i;
-    slen -= i;
+    struct xs_byteset set;
+    xs_byteset_init(&set, trimset);
+
+    size_t i = xs_scan(&set, dataptr, xs_size(x), true, false);
+    size_t slen = xs_scan(&set, dataptr + i, xs_size(x) - i, true, true);
+
+    if (xs_is_view(x)) {
+        /* a view narrows in place */
+        x->view_offset += i;
+        x->view_size = slen;
+        return x;
+    }
+    xs_cow_lazy_copy(x);
+    orig = xs_data(x);
+    dataptr = orig + i;
 
     /* reserved space as a buffer on the heap.
      * Do not reallocate immediately. Instead, reuse it as possible.
@@ -289,8 +661,61 @@ xs *xs_trim(xs *x, const char *trimset)
 
     xs_set_size(x, slen);
     return x;
-#undef check_bit
-#undef set_bit
+}
+
+/* Fields of an xs split at every byte of a delimiter set, as strsep() would
+ * cut them: adjacent delimiters give empty fields.  The iterator points into
+ * the string, which must not change until the iteration is over.
+ */
+typedef struct {
+    const xs *src;
+    const char *next; /* start of the next field */
+    size_t left;      /* bytes from next to the end */
+    bool done;
+    struct xs_byteset delims;
+} xs_split_iter;
+
+void xs_split_init(xs_split_iter *it, const xs *x, const char *delims)
+{
+    it->src = x;
+    it->next = xs_data(x);
+    it->left = xs_size(x);
+    it->done = false;
+    xs_byteset_init(&it->delims, delims);
+}
+
+/* Point ptr and len at the next field without copying it.  Returns false
+ * once every field has been seen.
+ */
+bool xs_split_next(xs_split_iter *it, const char **ptr, size_t *len)
+{
+    if (it->done)
+        return false;
+
+    size_t n = xs_scan(&it->delims, it->next, it->left, false, false);
+    *ptr = it->next;
+    *len = n;
+    if (n == it->left) {
+        it->done = true;
+    } else {
+        it->next += n + 1;
+        it->left -= n + 1;
+    }
+    return true;
+}
+
+/* Make field, which must hold a valid xs, the next field: on the stack when
+ * it is short, a view into the string otherwise.
+ */
+bool xs_split_next_xs(xs_split_iter *it, xs *field)
+{
+    const char *ptr;
+    size_t len;
+
+    if (!xs_split_next(it, &ptr, &len))
+        return false;
+    xs_slice(field, it->src, ptr - xs_data(it->src), len);
+    return true;
 }
 
 int main(int argc, char *argv[])
@@ -302,5 +727,38 @@ int main(int argc, char *argv[])
     xs prefix = *xs_tmp("((("), suffix = *xs_tmp(")))");
     xs_concat(&string, &prefix, &suffix);
     printf("[%s] : %2zu\n", xs_data(&string), xs_size(&string));
+
+    /* build a line at both ends */
+    xs line = xs_literal_empty();
+    char num[16];
+    for (int i = 0; i < 100; i++) {
+        snprintf(num, sizeof(num), " %d", i);
+        xs_append_cstr(&line, num);
+        xs_prepend(&line, "<", 1);
+    }
+    printf("[%.12s...%s] : %zu\n", xs_data(&line),
+           xs_data(&line) + xs_size(&line) - 6, xs_size(&line));
+
+    /* slices of it share its buffer */
+    xs word = xs_literal_empty();
+    xs_slice(&word, &line, 100, 40);
+    xs_trim(&word, "< ");
+    printf("[%.*s] : %zu, view %d, refcnt %d\n", (int) xs_size(&word),
+           xs_data(&word), xs_size(&word), xs_is_view(&word),
+           xs_get_refcnt(&line));
+    xs_free(&word);
+
+    /* walk the fields of a record */
+    xs record = xs_literal_empty();
+    xs_new(&record, "id=7;name=foo;;tag=a,b");
+    xs_split_iter it;
+    const char *field;
+    size_t len;
+    xs_split_init(&it, &record, ";,");
+    while (xs_split_next(&it, &field, &len))
+        printf("<%.*s>", (int) len, field);
+    printf("\n");
+    xs_free(&record);
+    xs_free(&line);
     return 0;
 }